@@ -10,6 +10,8 @@ extern "C" {
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 
 /*
@@ -31,14 +33,31 @@ typedef struct MasterBlock {
 	uint64 cookie;
 	BlockPid first_unused_block;
 	BlockPid last_block;
+	int64 unused_blocks_size;//the length of the list starting at first_unused_block
 } MasterBlock;
 
+//blocks can be referenced more than once, see block_share
+//only blocks with more than 1 reference have a BlockRef, they are kept in an open addressing hash table
+typedef struct BlockRef {
+	BlockPid pid;//0 if the entry is empty
+	int64 refs;
+} BlockRef;
+
 typedef union BlockDevice {
 	struct {
 		int device_id;
 		MasterBlock master;
 		int block_size;
 		uint64 blocks_total;
+		const byte* mapping;//read-only view of the whole device, see block_view
+		struct BlockIOPool* io_pool;//see device_start_io
+		int64 io_split_size;
+		int64 blocks_reserved;//see block_reserve
+		BlockRef* refs;
+		int64 refs_size;
+		int64 refs_capacity;//a power of 2
+		bool is_refs_dirty;//the device does not persist the table itself, see block_set_refs
+		pthread_mutex_t alloc_mutex;//held by every function that allocates, frees, reserves or counts references to blocks
 	};
 	struct {
 		int _;
@@ -95,11 +114,49 @@ bool block_reads  (BlockDevice* device, BlockPid pid, int offset, void* buffer,
 bool block_reads_m(BlockDevice* device, BlockPid pid, int offset, void* buffer, int buffer_size);
 //same as block_reads, except just like block_writes_m, relaxes all safety and debug checks on the validity of passed parameters
 
+const void* block_view(BlockDevice* device, BlockPid pid, int offset);
+//returns a read-only pointer to the stored contents of the block at the given offset, without copying them
+//the memory of consecutive blocks is consecutive, and it reflects every later write to those blocks
+//returns 0 if the device could not be mapped into memory, in which case block_reads must be used instead
+
+bool block_read_run  (BlockDevice* device, BlockPid pid, int64 blocks_size,       void* buffer);
+bool block_write_run (BlockDevice* device, BlockPid pid, int64 blocks_size, const void* buffer);
+//same as block_read and block_write, except blocks_size blocks starting from pid are transferred with a single positional I/O
+bool block_read_list (BlockDevice* device, const BlockPid* pids, int64 pids_size,       void* buffer);
+bool block_write_list(BlockDevice* device, const BlockPid* pids, int64 pids_size, const void* buffer);
+//transfers the blocks pids[0..pids_size) to or from consecutive block sized pieces of buffer
+//runs of consecutive pids are merged into a single I/O, and large lists are split into ranges executed by the I/O pool
+//a pid of 0 is read as a block of zeros, and is not allowed when writing
+
+bool device_start_io(BlockDevice* device, int threads_size, int64 split_size);
+//starts threads_size worker threads for block_read_list and block_write_list to execute ranges on
+//split_size is the minimum number of bytes in a range, lists smaller than twice this are executed on the calling thread
+//split_size may be tuned later by setting device->io_split_size
+void device_stop_io (BlockDevice* device);
+//called by device_close
+
 BlockPid block_alloc(BlockDevice* device);
 //returns the pid of an unalloced block, or 0 on failure
+BlockPid block_alloc_run(BlockDevice* device, int64 blocks_size, int64* ret_size);
+//returns the pid of the first of up to blocks_size unalloced blocks that are consecutive on the device, or 0 on failure
+//ret_size is set to the number of blocks that were alloced, this is at least 1
+int64    block_get_free_size(BlockDevice* device);
+//returns the number of blocks that can still be alloced, this excludes reserved blocks
+bool     block_reserve  (BlockDevice* device, int64 blocks_size);
+void     block_unreserve(BlockDevice* device, int64 blocks_size);
+//a reservation guarantees that blocks_size blocks will still be free when they are later alloced
+//block_reserve fails if there are not enough free blocks, the reservation must be undone before allocating the blocks
 bool     block_free (BlockDevice* device, BlockPid pid);//Returns 1 on success and 0 on failure
 //pid is the permanent id of an allocated block
-//the block gets unallocated, and reads and writes to it become undefined
+//one reference to the block is dropped, once the last is dropped the block gets unallocated, and reads and writes to it become undefined
+int64    block_get_refs(BlockDevice* device, BlockPid pid);
+//returns the number of references to an allocated block, every block starts with 1 when it is alloced
+bool     block_share   (BlockDevice* device, BlockPid pid);
+//adds a reference to the block, a block with more than 1 reference must not be written to, it must be copied instead
+void     block_set_refs(BlockDevice* device, BlockPid pid, int64 refs);
+//used to restore the reference counts of the device, any block with more than 1 reference must be saved
+//and restored by the user of the device, is_refs_dirty is set whenever a reference count changes
+//the functions above can be called from any number of threads at once, and so can reads and writes of blocks
 
 
 
@@ -108,6 +165,11 @@ bool     block_free (BlockDevice* device, BlockPid pid);//Returns 1 on success a
 #ifdef BLOCK_DEVICE_IMPLEMENTATION
 #undef BLOCK_DEVICE_IMPLEMENTATION
 
+static void device_map(BlockDevice* device) {
+	//a failed map is not an error, block_view will just return 0
+	void* mapping = mmap(0, device->block_size*device->blocks_total, PROT_READ, MAP_SHARED, device->device_id, 0);
+	device->mapping = (mapping == MAP_FAILED) ? 0 : cast(const byte*, mapping);
+}
 bool device_create(BlockDevice* device, const char* device_name, int block_size, uint64 blocks_total) {
 	ASSERT(block_size >= BLOCK_SIZE_MIN);
 	int device_id = open(device_name, O_RDWR | O_CREAT, 0644);
@@ -132,6 +194,16 @@ bool device_create(BlockDevice* device, const char* device_name, int block_size,
 	device->master.cookie = 1234567890;
 	device->master.first_unused_block = 0;
 	device->master.last_block = 1;
+	device->master.unused_blocks_size = 0;
+	device->io_pool = 0;
+	device->io_split_size = 0;
+	device->blocks_reserved = 0;
+	device->refs = 0;
+	device->refs_size = 0;
+	device->refs_capacity = 0;
+	device->is_refs_dirty = 0;
+	pthread_mutex_init(&device->alloc_mutex, 0);
+	device_map(device);
 	return 1;
 }
 bool device_open(BlockDevice* device, const char* device_name) {
@@ -146,6 +218,15 @@ bool device_open(BlockDevice* device, const char* device_name) {
 		return 0;
     } else {
 		device->device_id = device_id;
+		device->io_pool = 0;
+		device->io_split_size = 0;
+		device->blocks_reserved = 0;
+		device->refs = 0;
+		device->refs_size = 0;
+		device->refs_capacity = 0;
+		device->is_refs_dirty = 0;
+		pthread_mutex_init(&device->alloc_mutex, 0);
+		device_map(device);
 		return 1;
 	}
 }
@@ -154,6 +235,16 @@ bool device_save(BlockDevice* device) {
 }
 bool device_close(BlockDevice* device) {
 	if(device_save(device)) {
+		device_stop_io(device);
+		if(device->mapping) {
+			munmap(cast(void*, device->mapping), device->block_size*device->blocks_total);
+			device->mapping = 0;
+		}
+		free(device->refs);
+		device->refs = 0;
+		device->refs_size = 0;
+		device->refs_capacity = 0;
+		pthread_mutex_destroy(&device->alloc_mutex);
 		int ok = close(device->device_id);
 		if(ok != 0) {
 			//file didn't close???
@@ -170,35 +261,25 @@ bool block_read(BlockDevice* device, BlockPid pid, void* buffer) {
 		return 0;
 	}
 	ASSERT(pid < device->blocks_total);
-    int off = pid*device->block_size;
-    int succ = lseek(device->device_id, off, SEEK_SET);
-    if(succ != off) {
-		//seek failed
-        return 0;
-    }
+	off_t off = pid*device->block_size;
 	int read_size = device->block_size;
-    int n = read(device->device_id, buffer, read_size);
-    if(n != read_size) {
-        // raise some heck here - should never happen!
+	int n = pread(device->device_id, buffer, read_size, off);
+	if(n != read_size) {
+		// raise some heck here - should never happen!
 		return 0;
-    }
-    return 1;
+	}
+	return 1;
 }
 bool block_reads_m(BlockDevice* device, BlockPid pid, int offset, void* buffer, int buffer_size) {
 	if(!buffer_size) return 1;
-    int off = pid*device->block_size + offset;
-    int succ = lseek(device->device_id, off, SEEK_SET);
-    if(succ != off) {
-		//seek failed
-        return 0;
-    }
+	off_t off = pid*device->block_size + offset;
 	int read_size = buffer_size;
-    int n = read(device->device_id, buffer, read_size);
-    if(n != read_size) {
-        // raise some heck here - should never happen!
+	int n = pread(device->device_id, buffer, read_size, off);
+	if(n != read_size) {
+		// raise some heck here - should never happen!
 		return 0;
-    }
-    return 1;
+	}
+	return 1;
 }
 bool block_reads(BlockDevice* device, BlockPid pid, int offset, void* buffer, int buffer_size) {
 	ASSERT(pid);
@@ -214,41 +295,39 @@ bool block_reads(BlockDevice* device, BlockPid pid, int offset, void* buffer, in
 	}
 }
 
+const void* block_view(BlockDevice* device, BlockPid pid, int offset) {
+	ASSERT(pid);
+	ASSERT(pid < device->blocks_total);
+	ASSERT(offset >= 0 && offset <= device->block_size);
+	if(!device->mapping || !pid) return 0;
+	return &device->mapping[pid*device->block_size + offset];
+}
+
 bool block_write(BlockDevice* device, BlockPid pid, const void* buffer) {
 	ASSERT(pid);
 	if(!pid) {
 		return 0;
 	}
 	ASSERT(pid < device->blocks_total);
-	int off = pid*device->block_size;
-    int succ = lseek(device->device_id, off, SEEK_SET);
-    if(succ != off) {
-		//seek failed
-        return 0;
-    }
+	off_t off = pid*device->block_size;
 	int write_size = device->block_size;
-    int n = write(device->device_id, buffer, write_size);
-    if(n != write_size) {
-        // raise some heck here - should never happen!
+	int n = pwrite(device->device_id, buffer, write_size, off);
+	if(n != write_size) {
+		// raise some heck here - should never happen!
 		return 0;
-    }
-    return 1;
+	}
+	return 1;
 }
 bool block_writes_m(BlockDevice* device, BlockPid pid, int offset, const void* buffer, int buffer_size) {
 	if(!buffer_size) return 1;
-	int off = pid*device->block_size + offset;
-    int succ = lseek(device->device_id, off, SEEK_SET);
-    if(succ != off) {
-		//seek failed
-        return 0;
-    }
+	off_t off = pid*device->block_size + offset;
 	int write_size = buffer_size;
-    int n = write(device->device_id, buffer, write_size);
-    if(n != write_size) {
-        // raise some heck here - should never happen!
+	int n = pwrite(device->device_id, buffer, write_size, off);
+	if(n != write_size) {
+		// raise some heck here - should never happen!
 		return 0;
-    }
-    return 1;
+	}
+	return 1;
 }
 bool block_writes(BlockDevice* device, BlockPid pid, int offset, const void* buffer, int buffer_size) {
 	ASSERT(pid);
@@ -265,19 +344,314 @@ bool block_writes(BlockDevice* device, BlockPid pid, int offset, const void* buf
 }
 
 
-bool block_free(BlockDevice* device, BlockPid pid) {
+bool block_read_run(BlockDevice* device, BlockPid pid, int64 blocks_size, void* buffer) {
+	ASSERT(pid);
+	ASSERT(pid + blocks_size <= device->blocks_total);
+	off_t off = pid*device->block_size;
+	int64 left = blocks_size*device->block_size;
+	byte* cur = cast(byte*, buffer);
+	while(left > 0) {
+		//pread may transfer less than asked for on large runs, so we loop
+		ssize_t n = pread(device->device_id, cur, left, off);
+		if(n <= 0) return 0;
+		cur += n;
+		off += n;
+		left -= n;
+	}
+	return 1;
+}
+bool block_write_run(BlockDevice* device, BlockPid pid, int64 blocks_size, const void* buffer) {
+	ASSERT(pid);
+	ASSERT(pid + blocks_size <= device->blocks_total);
+	off_t off = pid*device->block_size;
+	int64 left = blocks_size*device->block_size;
+	const byte* cur = cast(const byte*, buffer);
+	while(left > 0) {
+		ssize_t n = pwrite(device->device_id, cur, left, off);
+		if(n <= 0) return 0;
+		cur += n;
+		off += n;
+		left -= n;
+	}
+	return 1;
+}
+
+
+typedef struct BlockIOJob {
+	BlockDevice* device;
+	const BlockPid* pids;
+	byte* buffer;
+	bool is_write;
+	bool has_failed;
+	int64 pids_size;
+	int64 range_size;//in blocks
+	int64 ranges_size;
+	int64 next_range;//every thread working on the job claims its next range from here with an atomic add
+} BlockIOJob;
+
+typedef struct BlockIOPool {
+	pthread_mutex_t mutex;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+	BlockIOJob* job;//0 when there is no job to join
+	uint64 job_id;
+	int workers_busy;
+	bool is_stopping;
+	int threads_size;
+	pthread_t threads[];
+} BlockIOPool;
+
+static void block_io_work(BlockIOJob* job) {
+	int block_size = job->device->block_size;
+	while(1) {
+		int64 range = __atomic_fetch_add(&job->next_range, 1, __ATOMIC_RELAXED);
+		if(range >= job->ranges_size) break;
+		int64 i = range*job->range_size;
+		int64 end = i + job->range_size;
+		if(end > job->pids_size) end = job->pids_size;
+		while(i < end) {
+			//merge the pids that are consecutive on the device into a single run
+			BlockPid pid = job->pids[i];
+			int64 run = 1;
+			if(pid) {
+				while(i + run < end && job->pids[i + run] == pid + run) run += 1;
+			} else {
+				while(i + run < end && !job->pids[i + run]) run += 1;
+			}
+			byte* mem = &job->buffer[i*block_size];
+			bool ok;
+			if(!pid) {
+				ASSERT(!job->is_write);
+				memzero(mem, run*block_size);
+				ok = !job->is_write;
+			} else if(job->is_write) {
+				ok = block_write_run(job->device, pid, run, mem);
+			} else {
+				ok = block_read_run(job->device, pid, run, mem);
+			}
+			if(!ok) __atomic_store_n(&job->has_failed, 1, __ATOMIC_RELAXED);
+			i += run;
+		}
+	}
+}
+static void* block_io_worker(void* arg) {
+	BlockIOPool* pool = cast(BlockIOPool*, arg);
+	uint64 last_job_id = 0;
+	pthread_mutex_lock(&pool->mutex);
+	while(1) {
+		while(!pool->is_stopping && (pool->job_id == last_job_id || !pool->job)) {
+			last_job_id = pool->job_id;
+			pthread_cond_wait(&pool->job_cond, &pool->mutex);
+		}
+		if(pool->is_stopping) break;
+		last_job_id = pool->job_id;
+		BlockIOJob* job = pool->job;
+		pool->workers_busy += 1;
+		pthread_mutex_unlock(&pool->mutex);
+		block_io_work(job);
+		pthread_mutex_lock(&pool->mutex);
+		pool->workers_busy -= 1;
+		if(!pool->workers_busy) {
+			pthread_cond_signal(&pool->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
+
+static bool block_io_list(BlockDevice* device, const BlockPid* pids, int64 pids_size, byte* buffer, bool is_write) {
+	BlockIOJob job;
+	job.device = device;
+	job.pids = pids;
+	job.buffer = buffer;
+	job.is_write = is_write;
+	job.has_failed = 0;
+	job.pids_size = pids_size;
+	job.next_range = 0;
+	BlockIOPool* pool = device->io_pool;
+	int64 split_blocks = (device->io_split_size + device->block_size - 1)/device->block_size;
+	if(!pool || split_blocks <= 0 || pids_size < 2*split_blocks) {
+		job.range_size = pids_size;
+		job.ranges_size = 1;
+		block_io_work(&job);
+		return !job.has_failed;
+	}
+	//give every thread a few ranges so that the ones that finish early can pick up the slack of the slow ones
+	int64 range_size = pids_size/(4*(pool->threads_size + 1));
+	job.range_size = (range_size > split_blocks) ? range_size : split_blocks;
+	job.ranges_size = (pids_size + job.range_size - 1)/job.range_size;
+	pthread_mutex_lock(&pool->mutex);
+	if(pool->job) {
+		//the pool is working on another thread's job, so this one is done by the calling thread alone
+		pthread_mutex_unlock(&pool->mutex);
+		block_io_work(&job);
+		return !job.has_failed;
+	}
+	pool->job = &job;
+	pool->job_id += 1;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	//the calling thread works on the job too
+	block_io_work(&job);
+	pthread_mutex_lock(&pool->mutex);
+	while(pool->workers_busy) {
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+	pool->job = 0;
+	pthread_mutex_unlock(&pool->mutex);
+	return !job.has_failed;
+}
+bool block_read_list(BlockDevice* device, const BlockPid* pids, int64 pids_size, void* buffer) {
+	return block_io_list(device, pids, pids_size, cast(byte*, buffer), 0);
+}
+bool block_write_list(BlockDevice* device, const BlockPid* pids, int64 pids_size, const void* buffer) {
+	return block_io_list(device, pids, pids_size, cast(byte*, buffer), 1);
+}
+
+bool device_start_io(BlockDevice* device, int threads_size, int64 split_size) {
+	ASSERT(!device->io_pool);
+	device->io_split_size = split_size;
+	if(threads_size <= 0) return 1;
+	BlockIOPool* pool = cast(BlockIOPool*, malloc(sizeof(BlockIOPool) + threads_size*sizeof(pthread_t)));
+	pthread_mutex_init(&pool->mutex, 0);
+	pthread_cond_init(&pool->job_cond, 0);
+	pthread_cond_init(&pool->done_cond, 0);
+	pool->job = 0;
+	pool->job_id = 0;
+	pool->workers_busy = 0;
+	pool->is_stopping = 0;
+	pool->threads_size = 0;
+	device->io_pool = pool;
+	for_each_lt(i, threads_size) {
+		if(pthread_create(&pool->threads[i], 0, block_io_worker, pool) != 0) {
+			device_stop_io(device);
+			return 0;
+		}
+		pool->threads_size += 1;
+	}
+	return 1;
+}
+void device_stop_io(BlockDevice* device) {
+	BlockIOPool* pool = device->io_pool;
+	if(!pool) return;
+	pthread_mutex_lock(&pool->mutex);
+	pool->is_stopping = 1;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for_each_lt(i, pool->threads_size) {
+		pthread_join(pool->threads[i], 0);
+	}
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->job_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	free(pool);
+	device->io_pool = 0;
+}
+
+
+static int64 block_ref_home(BlockDevice* device, BlockPid pid) {
+	uint64 hash = cast(uint64, pid)*0x9E3779B97F4A7C15;
+	return (hash^(hash>>32))&(device->refs_capacity - 1);
+}
+static int64 block_find_ref(BlockDevice* device, BlockPid pid) {
+	//linear probing, returns the index pid is at or would be inserted at
+	int64 mask = device->refs_capacity - 1;
+	int64 i = block_ref_home(device, pid);
+	while(device->refs[i].pid && device->refs[i].pid != pid) {
+		i = (i + 1)&mask;
+	}
+	return i;
+}
+static int64 block_get_refs_(BlockDevice* device, BlockPid pid) {
+	if(!device->refs_size) return 1;
+	BlockRef* ref = &device->refs[block_find_ref(device, pid)];
+	return ref->pid ? ref->refs : 1;
+}
+static void block_set_refs_(BlockDevice* device, BlockPid pid, int64 refs) {
+	ASSERT(pid);
+	ASSERT(refs >= 1);
+	if(refs > 1) {
+		if(4*(device->refs_size + 1) > 3*device->refs_capacity) {
+			//grow the table and reinsert everything
+			BlockRef* old_refs = device->refs;
+			int64 old_capacity = device->refs_capacity;
+			device->refs_capacity = old_capacity ? 2*old_capacity : 64;
+			device->refs = cast(BlockRef*, calloc(device->refs_capacity, sizeof(BlockRef)));
+			for_each_lt(j, old_capacity) {
+				if(old_refs[j].pid) {
+					device->refs[block_find_ref(device, old_refs[j].pid)] = old_refs[j];
+				}
+			}
+			free(old_refs);
+		}
+		BlockRef* ref = &device->refs[block_find_ref(device, pid)];
+		if(!ref->pid) {
+			ref->pid = pid;
+			device->refs_size += 1;
+		}
+		ref->refs = refs;
+	} else if(device->refs_size) {
+		int64 mask = device->refs_capacity - 1;
+		int64 hole = block_find_ref(device, pid);
+		if(!device->refs[hole].pid) return;
+		//backward shift deletion, entries after the hole that could have been placed in it are moved back into it
+		int64 i = hole;
+		while(1) {
+			i = (i + 1)&mask;
+			BlockPid cur_pid = device->refs[i].pid;
+			if(!cur_pid) break;
+			int64 home = block_ref_home(device, cur_pid);
+			if(((i - home)&mask) >= ((i - hole)&mask)) {
+				device->refs[hole] = device->refs[i];
+				hole = i;
+			}
+		}
+		device->refs[hole].pid = 0;
+		device->refs_size -= 1;
+	}
+	device->is_refs_dirty = 1;
+}
+static bool block_share_(BlockDevice* device, BlockPid pid) {
+	ASSERT(pid < device->master.last_block);
+	block_set_refs_(device, pid, block_get_refs_(device, pid) + 1);
+	return 1;
+}
+
+static bool block_free_(BlockDevice* device, BlockPid pid) {
 	MasterBlock* master = &device->master;
 	ASSERT(pid < master->last_block);
+	int64 refs = block_get_refs_(device, pid);
+	if(refs > 1) {
+		//the block is still in use elsewhere
+		block_set_refs_(device, pid, refs - 1);
+		return 1;
+	}
 	if(block_writes(device, pid, 0, &master->first_unused_block, sizeof(BlockPid))) {
 		master->first_unused_block = pid;
+		master->unused_blocks_size += 1;
 		return 1;
 	} else {
 		return 0;
 	}
 
 }
-BlockPid block_alloc(BlockDevice* device) {
+static int64 block_get_free_size_(BlockDevice* device) {
+	MasterBlock* master = &device->master;
+	return device->blocks_total - master->last_block + master->unused_blocks_size - device->blocks_reserved;
+}
+static bool block_reserve_(BlockDevice* device, int64 blocks_size) {
+	if(block_get_free_size_(device) < blocks_size) return 0;
+	device->blocks_reserved += blocks_size;
+	return 1;
+}
+static void block_unreserve_(BlockDevice* device, int64 blocks_size) {
+	ASSERT(blocks_size <= device->blocks_reserved);
+	device->blocks_reserved -= blocks_size;
+}
+
+static BlockPid block_alloc_(BlockDevice* device) {
 	MasterBlock* master = &device->master;
+	if(block_get_free_size_(device) <= 0) return 0;
 	BlockPid block = master->first_unused_block;
 	if(block) {
 		//TODO: Read less of the block and error check
@@ -285,6 +659,7 @@ BlockPid block_alloc(BlockDevice* device) {
 		if(block_reads(device, block, 0, &next_block, sizeof(BlockPid))) {
 			ASSERT(next_block < master->last_block);
 			master->first_unused_block = next_block;
+			master->unused_blocks_size -= 1;
 		} else {
 			return 0;
 		}
@@ -298,6 +673,80 @@ BlockPid block_alloc(BlockDevice* device) {
 
 	return block;
 }
+static BlockPid block_alloc_run_(BlockDevice* device, int64 blocks_size, int64* ret_size) {
+	MasterBlock* master = &device->master;
+	*ret_size = 0;
+	int64 free_size = block_get_free_size_(device);
+	if(free_size <= 0) return 0;
+	//the never used blocks at the end of the device are the only ones we know to be consecutive
+	//so runs come from there, and we only fall back to the unused list once they run out
+	int64 end_size = device->blocks_total - master->last_block;
+	if(blocks_size > free_size) blocks_size = free_size;
+	if(end_size > 0) {
+		BlockPid block = master->last_block;
+		*ret_size = (blocks_size < end_size) ? blocks_size : end_size;
+		master->last_block += *ret_size;
+		return block;
+	}
+	BlockPid block = block_alloc_(device);
+	if(block) *ret_size = 1;
+	return block;
+}
+
+
+//the public functions just hold the device's alloc_mutex around the ones above, which call each other
+int64 block_get_refs(BlockDevice* device, BlockPid pid) {
+	pthread_mutex_lock(&device->alloc_mutex);
+	int64 refs = block_get_refs_(device, pid);
+	pthread_mutex_unlock(&device->alloc_mutex);
+	return refs;
+}
+void block_set_refs(BlockDevice* device, BlockPid pid, int64 refs) {
+	pthread_mutex_lock(&device->alloc_mutex);
+	block_set_refs_(device, pid, refs);
+	pthread_mutex_unlock(&device->alloc_mutex);
+}
+bool block_share(BlockDevice* device, BlockPid pid) {
+	pthread_mutex_lock(&device->alloc_mutex);
+	bool ok = block_share_(device, pid);
+	pthread_mutex_unlock(&device->alloc_mutex);
+	return ok;
+}
+bool block_free(BlockDevice* device, BlockPid pid) {
+	pthread_mutex_lock(&device->alloc_mutex);
+	bool ok = block_free_(device, pid);
+	pthread_mutex_unlock(&device->alloc_mutex);
+	return ok;
+}
+int64 block_get_free_size(BlockDevice* device) {
+	pthread_mutex_lock(&device->alloc_mutex);
+	int64 free_size = block_get_free_size_(device);
+	pthread_mutex_unlock(&device->alloc_mutex);
+	return free_size;
+}
+bool block_reserve(BlockDevice* device, int64 blocks_size) {
+	pthread_mutex_lock(&device->alloc_mutex);
+	bool ok = block_reserve_(device, blocks_size);
+	pthread_mutex_unlock(&device->alloc_mutex);
+	return ok;
+}
+void block_unreserve(BlockDevice* device, int64 blocks_size) {
+	pthread_mutex_lock(&device->alloc_mutex);
+	block_unreserve_(device, blocks_size);
+	pthread_mutex_unlock(&device->alloc_mutex);
+}
+BlockPid block_alloc_run(BlockDevice* device, int64 blocks_size, int64* ret_size) {
+	pthread_mutex_lock(&device->alloc_mutex);
+	BlockPid block = block_alloc_run_(device, blocks_size, ret_size);
+	pthread_mutex_unlock(&device->alloc_mutex);
+	return block;
+}
+BlockPid block_alloc(BlockDevice* device) {
+	pthread_mutex_lock(&device->alloc_mutex);
+	BlockPid block = block_alloc_(device);
+	pthread_mutex_unlock(&device->alloc_mutex);
+	return block;
+}
 
 #endif
 
@@ -1,4 +1,5 @@
 
 
-gcc -g -o shell shell.c -lreadline
+gcc -g -o shell shell.c -lreadline -lpthread
 echo "enter ./shell to begin shell debugging mode"
+echo "enter bench <threads> in the shell, after newfs, to measure how file operations and data scale with threads"
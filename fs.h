@@ -10,13 +10,25 @@ extern "C" {
 
 typedef struct File File;
 typedef struct FS FS;
+typedef struct DirReader DirReader;
 
-#define DIR_CACHE_SIZE 32*MEGABYTE
+#ifndef DIR_CACHE_SIZE
+#define DIR_CACHE_SIZE 32*MEGABYTE//the memory the cached files and their names can take up
+#endif
+#define FS_NAME_MAX 255//the longest name a file can have, creating a file with a longer name fails
 
 bool fs_init   (FS* fs, const char* device_name, uint64 device_capacity);
 bool fs_mount  (FS* fs, const char* device_name);
 bool fs_unmount(FS* fs);
 bool fs_save   (FS* fs);
+bool fs_set_concurrent(FS* fs, bool is_enabled);
+//in concurrent mode the functions below can be called from any number of threads at once, while fs_save, fs_unmount
+//and fs_set_concurrent can only be called while no other call is running
+//lookups in different directories and reads and writes of different files run in parallel; lookups of names
+//that are cached and reads of the same file run in parallel too. every File* a lookup, fs_resolve_path or
+//fs_clone_file hands out comes pinned, and has to be unpinned once the caller is done with it
+//fs_get_first_child can't be used, see fs_open_reader instead, and delayed allocation is disabled
+//enabling it fails if the data held by delayed allocation could not be flushed
 
 File* fs_get_root(FS* fs);
 
@@ -24,62 +36,340 @@ bool fs_get_file (FS* fs, File* dir, const char* name, uint16 name_size, File**
 bool fs_open_file(FS* fs, File* dir, const char* name, uint16 name_size, File** ret_file);
 bool fs_get_dir  (FS* fs, File* dir, const char* name, uint16 name_size, File** ret_file);
 bool fs_open_dir (FS* fs, File* dir, const char* name, uint16 name_size, File** ret_file);
+bool fs_clone_file(FS* fs, File* dir, const char* name, uint16 name_size, File* file, File** ret_file);
+//creates a file in dir with the same contents as file, without copying any of its data
+//the two files share their blocks on the device until one of them is written to, then only the blocks written are copied
+//ret_file is set to 0 if the name is already taken
+bool fs_unlink(FS* fs, File* dir, const char* name, uint16 name_size);
+bool fs_rmdir (FS* fs, File* dir, const char* name, uint16 name_size);
+//removes the file or the empty directory name names in dir, failing if it is missing, is the wrong kind,
+//or is pinned by anyone else, which includes open handles and readers. removing takes the same time however large
+//the file is; its entry stays on the device until the next save, which hands the file to a thread of its own that
+//frees its blocks, so the space comes back once that save is done. a save that fails keeps them for the next one
+bool fs_rename(FS* fs, File* src_dir, const char* name, uint16 name_size, File* dst_dir, const char* new_name, uint16 new_name_size);
+//moves what name names in src_dir to dst_dir under new_name, only the entries of the two directories change
+//a file, or an empty directory, that new_name already names is replaced in the same step and removed like by fs_unlink
+//fails if name is missing, if new_name names something of the other kind or that is pinned, or if a directory would
+//end up below itself. in concurrent mode, moving a directory to another one waits for any other such move
+//on the device the new entry is written before the old one is removed, so a save that fails in between, or a crash
+//during it, leaves the file under both names, never under neither, until a save succeeds. a file that was replaced
+//is only destroyed once the new entry is saved, so until then it is still found under new_name after a crash
 bool fs_get_any  (FS* fs, File* dir, const char* name, uint16 name_size, File** ret_file);
+#define FS_PATH_FILE   0b1//the path must name a file
+#define FS_PATH_DIR    0b10//the path must name a directory
+#define FS_PATH_CREATE 0b100//the last name in the path is created if it is missing, as a directory if FS_PATH_DIR is set
+bool fs_resolve_path(FS* fs, File* dir, const char* path, uint path_size, uint flags, File** ret_file);
+//looks up each name of a path separated by '/', from the root if the path starts with '/' and from dir otherwise
+//empty names and "." are skipped; ret_file is set to 0 if a name is missing, or if what it names is the wrong kind
+//a File* handed out stays valid until the next call that can cache files: the lookups above and fs_get_first_child
+//the root is never evicted
+//once the cache is full, the children of the least recently used directories are evicted to make room, unless pinned
+void fs_pin  (File* file);
+void fs_unpin(File* file);
+//a pinned file stays valid, and so does every directory above it
+//a file must be pinned while it is used across calls, like a working directory
 
 bool fs_is_dir(File* file);
 bool fs_get_first_child(FS* fs, File* dir, File** ret_file);
 File* fs_get_next_child(FS* fs, File* dir, File* child);
+//caches every child of dir first, see fs_open_reader for listing a directory without doing so
+
+typedef struct DirEntry {
+	const char* name;//valid until the next call with the reader
+	uint16 name_size;
+	bool is_dir;
+	uint64 id;//the pid of the file's inode, no two files that exist at once share one
+} DirEntry;
+bool fs_open_reader(FS* fs, File* dir, DirReader** ret_reader);
+bool fs_read_dir   (FS* fs, DirReader* reader, DirEntry** ret_entry);
+void fs_close_reader(FS* fs, DirReader* reader);
+//lists dir straight from its file a leaf at a time, without caching any of its children, in a fixed amount of memory
+//fs_read_dir sets ret_entry to 0 once every entry has been returned; dir stays pinned until the reader is closed
+//if the directory is changed or saved while it is being read, the entries changed may be missed or returned twice
 
 uint fs_filename_size(File* file);
 void fs_get_filename(File* file, char* ret_name);
-void fs_set_filename(FS* fs, File* file, const char* name, uint16 name_size);
 int  fs_cmp_filename(File* file, const char* name, uint16 name_size);
 
-uint64 fs_get_size(File* file);
+bool fs_get_size(FS* fs, File* file, uint64* ret_size);
 bool fs_set_size(FS* fs, File* file, uint64 mem_size);
 bool fs_read    (FS* fs, File* file, uint64 mem_offset,       void* mem, uint64 mem_size);
 bool fs_write   (FS* fs, File* file, uint64 mem_offset, const void* mem, uint64 mem_size);
+bool fs_append  (FS* fs, File* file,                    const void* mem, uint64 mem_size);
+//writes to the end of the file; the last block of the file is kept in memory along with the path to it,
+//so only blocks that have been filled are written to the device. the rest is written when the file is saved
+bool fs_preallocate(FS* fs, File* file, uint64 mem_offset, uint64 mem_size);
+//gives every part of the range that has no blocks yet consecutive blocks on the device, growing the file if needed
+//the blocks are marked unwritten instead of being zeroed, so they read as zeros, and later writes to them need no allocation
+
+bool   fs_open (FS* fs, File* file, int* ret_handle);
+void   fs_close(FS* fs, int handle);
+bool   fs_read_next (FS* fs, int handle,       void* mem, uint64 mem_size, uint64* ret_size);
+bool   fs_write_next(FS* fs, int handle, const void* mem, uint64 mem_size);
+void   fs_seek(FS* fs, int handle, uint64 mem_offset);
+uint64 fs_tell(FS* fs, int handle);
+//a handle reads and writes file from a position that starts at 0 and moves past whatever was read or written
+//it keeps the pointer block it last went through and the last block it read part of in memory, so reading a file
+//in order only goes to the device for the data, and small reads only once per block. writes at the end of the file
+//are appends, see fs_append. fs_read_next sets ret_size to less than mem_size only at the end of the file
+//file stays pinned until the handle is closed; a handle can't be used from two threads at once
+
+bool fs_set_delayed_alloc(FS* fs, bool is_enabled);//ignored in concurrent mode
+//while delayed allocation is enabled, data written to blocks of a file that don't exist yet is held in memory
+//and only a reservation is made against free space; the blocks are then allocated in long consecutive runs
+//when the file is saved, or when too much data is held in memory. disabling it flushes every file,
+//and fails, leaving it enabled, if that fails
+bool fs_get_extents(FS* fs, File* file, int64* ret_blocks_size, int64* ret_extents_size);
+//reports how fragmented the file is on the device, extents are runs of data blocks that are consecutive on the device
+
+bool fs_acquire_view(FS* fs, File* file, uint64 mem_offset, uint64 mem_size, const void** ret_mem, uint64* ret_size);
+//like fs_read, but instead of copying the file's data, ret_mem is pointed at a read-only view of it
+//ret_size is set to how much of mem_size the view covers, call again from mem_offset + *ret_size for the rest
+//fails if the device could not be mapped into memory, in which case fs_read must be used instead
+void fs_release_view(FS* fs, File* file, const void* mem);
+//file stays pinned while a view of it is held; writing to it, truncating it or removing it before every view
+//of it is released is caught by an assert
 
 
 
 #include "block_device.h"
 #include "inode.h"
 #include "mam_alloc.h"
+#include <sched.h>
 
 
-#define DIR_IS_CACHED 0b1
+#define DIR_IS_CACHED 0b1//every child of the directory is cached, not just the ones looked up
 #define FILE_IS_DIRTY  0b10
 // #define FILE_IN_USE  0b100
+#define FILE_IS_NEW   0b1000//the file has no entry in its parent's directory file yet
+#define FILE_NO_INODE 0b10000//only the pid and status of the inode are known, see fs_load_inode
+#define DIR_IS_RESTORING 0b100000//none of the children can be evicted while the rest are being cached
+#define FILE_IS_REMOVED 0b1000000//removed while dirty, it is freed once fs_save takes it off fs->dirty
+#define DIR_IS_SAVE_FAILED 0b10000000//a save stopped part of the way, so its new children may have entries already
+#define FILE_NAME_INLINE 40//names up to this long are kept in the File itself
 struct File {
-	struct Filename* name;
+	union {
+		char name_inline[FILE_NAME_INLINE];
+		char* name_long;//a slot of the dir cache to itself, a File is always big enough to hold FS_NAME_MAX bytes
+	};
 	struct File* next;
 	struct File* head_child;
+	struct DelayedData* delayed;//see fs_set_delayed_alloc
+	union {
+		struct FileTail* tail;//for files, see fs_append
+		uint64 saves;//for directories, bumped whenever their changes are reordered or written to their file, see DirReader
+	};
+	struct DirIndex* index;//see fs_get_any
+	struct DirChanges* changes;//see fs_save_dir
+	struct File* lru_prev;//the directories with cached children are kept in order of use, see fs_evict_lru
+	union {
+		struct File* lru_next;//for directories
+		uint32 views;//for files, the views of it that are held, see fs_acquire_view
+	};
+	struct File* dirty_next;//the files changed since the last save are kept in a list, see fs_set_dirty
+	uint32 pins;
+	uint32 name_hash;
 	uint16 name_size;
 	uint16 flags;
+	union {
+		uint32 lru_epoch;//for directories, see fs_touch_dir
+		uint32 writes;//for files, bumped whenever the file's data or blocks change, see FileHandle
+	};
 	INode inode;
 };
-#define FILENAME_TEXT_SIZE (sizeof(File) - sizeof(struct Filename*))
-typedef struct Filename {
-	struct Filename* next;
-	char text[FILENAME_TEXT_SIZE];
-} Filename;
+_Static_assert(sizeof(File) >= FS_NAME_MAX, "a long name takes a slot of the dir cache, which is the size of a File");
+
+typedef struct DelayedBlock {
+	int64 block_offset;
+	byte* mem;
+} DelayedBlock;
+typedef struct DelayedData {
+	int64 blocks_reserved;
+	int blocks_size;
+	int blocks_capacity;
+	DelayedBlock blocks[];//sorted by block_offset
+} DelayedData;
+//every cached directory indexes its children by the hash of their name, in an open addressing hash table
+typedef struct DirIndex {
+	uint32 size;
+	uint32 capacity;//a power of 2
+	File* files[];//0 if the slot is empty
+} DirIndex;
+#define DIR_INDEX_CAPACITY_MIN 16
+//names that were looked up and not found in a directory that isn't fully cached, so looking them up again reads nothing
+//the table is split into sets of DIR_NEGATIVES_WAYS slots picked by the directory's pid and the name's hash
+//a name goes in an empty slot of its set, or replaces one, there is no other bookkeeping
+typedef struct DirNegative {
+	INodePid dir_pid;
+	uint32 name_hash;
+	uint16 name_size;//0 if the slot is empty
+	char name[50];//longer names are not remembered
+} DirNegative;
+#define DIR_NEGATIVES_BITS 10//of the number of sets
+#define DIR_NEGATIVES_WAYS 4
+#define DIR_NEGATIVES_SIZE (DIR_NEGATIVES_WAYS << DIR_NEGATIVES_BITS)
+//the inode of a removed file, kept until the removal of its entry is saved, see fs_drop_child
+typedef struct Unlinked {
+	struct Unlinked* next;
+	INode inode;
+} Unlinked;
+//the entries of a directory's file that have to be added or removed when it is next saved
+typedef struct DirChange {
+	uint32 hash;
+	INodePid pid;
+	File* file;//the child to add an entry for, or 0 if the entry with pid is being removed
+	Unlinked* unlinked;//for a removal, the inodes handed to the destroyer once it is saved
+	bool is_moved;//a removal of an entry the file now has another one for, saved after every add, see fs_save_dirty_
+} DirChange;
+typedef struct DirChanges {
+	int size;
+	int capacity;
+	DirChange changes[];
+} DirChanges;
+typedef struct FileTail {
+	INodeCursor cursor;//positioned at the last block of the file
+	bool is_dirty;
+	byte mem[];//the contents of the block at the cursor
+} FileTail;
+
+#define FS_DELAYED_BLOCKS_MAX ((8*MEGABYTE)/FS_BLOCK_SIZE)//once more blocks than this are held in memory, the file being written is flushed
+
+//in concurrent mode cached names are looked up without taking any lock, see fs_enter_lookup
+//each lookup counts itself in one of these while it runs, picked by its thread
+typedef struct LookupCount {
+	uint64 count;
+	byte pad[56];//so lookups on different threads don't write to the same cache line
+} LookupCount;
+#define FS_LOOKUP_STRIPES 64
+//memory that a lookup may still be reading, it is freed once every lookup that started before it was retired is done
+typedef struct Retired {
+	void* mem;
+	bool is_cached;//mem is a slot of the dir cache, otherwise it was malloced
+} Retired;
+#define FS_RETIRED_MAX 256//once this many are waiting they are freed, by the next allocation from the dir cache
+#define FILE_PINS_EVICTED 0x80000000u//set in the pins of a file that is being evicted, see fs_try_pin
+//see fs_open
+typedef struct FileHandle {
+	File* file;//0 if the handle is closed
+	int next_free;//the next closed handle, or -1
+	uint64 offset;
+	uint32 writes;//file->writes when map and mem were read, neither is used once it changes
+	int64 map_offset;//the block of data the first pid in map is for, or -1 if map holds nothing
+	int64 mem_offset;//the block of data held in mem, or -1
+	INodeCursor cursor;
+	BlockPid* map;//a copy of the pointer block holding the pids of the blocks being read
+	byte* mem;
+} FileHandle;
+#define FS_HANDLE_CHUNK_SIZE 64//handles are allocated this many at a time, and never move once they are
+#define FS_HANDLE_CHUNKS_MAX 1024
 
-//TODO: create a proper directory cache with an eviction policy
 struct FS {
 	BlockDevice device;
 	INodeAllocator inode_a;
 	File root;
 	MamPool* dir_cache;
+	File* lru_head;//the most recently used directory
+	File* lru_tail;
+	File* dirty;//every file with FILE_IS_DIRTY set, so saving only visits what changed
+	int dirty_size;
+	uint64 cache_hits;//lookups answered from the cache
+	uint64 cache_misses;//lookups that had to read the directory
+	uint64 cache_evictions;//times the children of a directory were evicted
+	uint64 cache_files_evicted;
+	uint64 cache_negative_hits;//lookups of missing names answered by fs->negatives
+	DirNegative* negatives;//see fs_get_any
+	uint64 view_bytes;//number of bytes handed out by fs_acquire_view instead of being copied
+	bool is_delayed_alloc;
+	int64 delayed_blocks_size;
+	bool is_concurrent;//see fs_set_concurrent
+	pthread_rwlock_t* locks;//FS_LOCKS_SIZE of them, a file is guarded by the one its address hashes to, see fs_get_lock
+	pthread_mutex_t cache_lock;//held while the dir cache, the lru list, fs->negatives or fs->dirty are used
+	uint32 lru_epoch;//bumped every time children are evicted, see fs_touch_dir
+	uint32 lookup_epoch;//see fs_wait_lookups
+	LookupCount* lookups;//2*FS_LOOKUP_STRIPES of them, the ones of lookups that started while lookup_epoch was even come first
+	pthread_mutex_t retired_lock;//taken after every other lock
+	Retired* retired;
+	int retired_size;
+	int retired_capacity;
+	FileHandle** handle_chunks;//FS_HANDLE_CHUNKS_MAX of them, see fs_open
+	int handles_size;//handed out at least once
+	int handles_free;//the most recently closed handle, or -1
+	pthread_mutex_t handles_lock;//held while handles are opened or closed
+	pthread_mutex_t moves_lock;//held while a directory is moved to another one, see fs_rename
+	INode* unlinked;//the inodes of removed files, waiting to be destroyed by fs->destroyer, see fs_unlink
+	int unlinked_size;
+	int unlinked_capacity;
+	bool is_destroying;//the destroyer is destroying inodes it took off unlinked
+	bool is_destroy_failed;//since the last save, see fs_save
+	bool has_destroyer;//started by the first removal
+	bool is_stopping;
+	pthread_t destroyer;
+	pthread_mutex_t unlinked_lock;
+	pthread_cond_t unlinked_cond;//signalled when inodes are added to unlinked and when the destroyer is done with them
 };
+#define FS_LOCKS_BITS 10
+#define FS_LOCKS_SIZE (1 << FS_LOCKS_BITS)
 
 
+//a directory's file is a B-tree of DIR_NODE_SIZE nodes keyed by the hash of the names in it, node 0 is always the root
+//leaves hold entries packed one after the other, branch nodes hold a DirBranch per child, both sorted by hash
+typedef struct DirNodeHeader {
+	uint16 level;//0 for leaves
+	uint16 records_size;
+	uint32 mem_size;//bytes of the node in use, including this header
+	uint32 next;//for leaves, the next leaf in hash order, 0 for the last one
+	uint32 removed_size;//in the root, bytes of entries removed since the tree was last rebuilt
+} DirNodeHeader;
+typedef struct DirBranch {
+	uint32 hash;//no hash in the child is below this, and none in the child before it is above it
+	uint32 node;
+} DirBranch;
 typedef struct DirEntryHeader {
 	INodePid pid;
+	uint32 hash;
 	uint16 name_size;
+	uint16 status;//of the inode, so the directory can be listed without reading any inodes
 } DirEntryHeader;
-#define SIZEOF_HEADER (sizeof(INodePid) + sizeof(uint16))
+#define SIZEOF_HEADER (sizeof(INodePid) + sizeof(uint32) + 2*sizeof(uint16))
 
 #define FS_BLOCK_SIZE 512
+#define DIR_NODE_SIZE (8*FS_BLOCK_SIZE)
+#define DIR_LEVEL_MAX 8
+#define DIR_FILL_SIZE ((3*DIR_NODE_SIZE)/4)//how full a rebuilt node is, leaving room for entries added later
+typedef struct DirPath {
+	int depth;//of the leaf
+	uint32 nodes[DIR_LEVEL_MAX];
+	uint32 offsets[DIR_LEVEL_MAX];//of the record the path goes through in each node
+	int64 low;//the hash of the branch to the leaf, the leaf holds the hashes above low up to bound
+	uint64 bound;//the hash of the branch after the leaf, so past any hash if there is none
+	byte mem[DIR_LEVEL_MAX][DIR_NODE_SIZE];
+	byte split_mem[2*DIR_NODE_SIZE];
+} DirPath;
+typedef struct PidList {
+	int size;
+	int capacity;
+	INodePid* pids;
+} PidList;
+struct DirReader {
+	File* dir;
+	int change_i;//the children added since the directory was last saved are read first, from its changes
+	PidList added;//the pids of those children, sorted once they have all been read, so they are skipped in the file
+	int added_sorted;//how many of added are sorted, the list is walked again from the start after a save
+	bool is_changes_done;
+	bool is_leaves_done;
+	uint64 saves;//dir->saves when the leaf was read, the leaf is found again from hash if it changed
+	uint32 hash;//of the last entry read from the directory's file
+	PidList run;//the pids of the entries read with hash, a run of equal hashes can continue into the next leaf
+	bool is_refound;//the leaf was found again from hash, so entries in run have to be skipped
+	uint32 offset;//of the next entry in the leaf
+	int removed_size;
+	DirChange* removed;//the entries of the leaf waiting to be removed are skipped, see fs_get_keys
+	DirEntry entry;
+	char name[FS_NAME_MAX];
+	DirPath path;//the leaf is path.mem[path.depth]
+};
+#define FS_IO_THREADS_MAX 16
+#define FS_IO_SPLIT_SIZE (128*KILOBYTE)//reads and writes of at least twice this size are split across the I/O threads
 
 
 #endif
@@ -94,168 +384,1759 @@ typedef struct DirEntryHeader {
 #define MAM_ALLOC_IMPLEMENTATION
 #include "mam_alloc.h"
 
-static bool fs_init_file(FS* fs, File* file, const char* name, uint16 name_size, uint16 status) {
+static uint32 fs_hash_filename(uint32 hash, const char* name, uint name_size) {
+	//FNV-1a, continues from hash so that a name can be hashed a piece at a time
+	for_each_lt(i, name_size) {
+		hash = (hash^cast(byte, name[i]))*16777619;
+	}
+	return hash;
+}
+#define FS_HASH_SEED 2166136261u
+static const char* fs_filename_text(File* file) {
+	return (file->name_size > FILE_NAME_INLINE) ? file->name_long : file->name_inline;
+}
+
+//in concurrent mode the fields of a file are guarded by its lock, except for its place among its siblings, which is
+//guarded by its parent's lock, and its pins, which are atomic. locks are taken in the order fs->moves_lock, file, fs->cache_lock,
+//inode allocator, device, and only fs_lock_two holds two files at once; eviction only ever tries the locks it takes
+static pthread_rwlock_t* fs_get_lock(FS* fs, File* file) {
+	//files are 256 bytes apart, so the low bits of the address are dropped before it is hashed
+	return &fs->locks[((cast(uint64, file) >> 8)*0x9E3779B97F4A7C15ull) >> (64 - FS_LOCKS_BITS)];
+}
+static void fs_lock_read(FS* fs, File* file) {
+	if(fs->is_concurrent) pthread_rwlock_rdlock(fs_get_lock(fs, file));
+}
+static void fs_lock_write(FS* fs, File* file) {
+	if(fs->is_concurrent) pthread_rwlock_wrlock(fs_get_lock(fs, file));
+}
+static bool fs_try_lock_write(FS* fs, File* file) {
+	//also fails if the calling thread already holds the lock, as it may share it with another file
+	return !fs->is_concurrent || pthread_rwlock_trywrlock(fs_get_lock(fs, file)) == 0;
+}
+static void fs_unlock(FS* fs, File* file) {
+	if(fs->is_concurrent) pthread_rwlock_unlock(fs_get_lock(fs, file));
+}
+static void fs_lock_two(FS* fs, File* file_a, File* file_b) {
+	//always in address order, so two threads can't each hold the lock the other is waiting on
+	if(!fs->is_concurrent) return;
+	pthread_rwlock_t* lock_a = fs_get_lock(fs, file_a);
+	pthread_rwlock_t* lock_b = fs_get_lock(fs, file_b);
+	pthread_rwlock_wrlock((lock_a < lock_b) ? lock_a : lock_b);
+	if(lock_a != lock_b) pthread_rwlock_wrlock((lock_a < lock_b) ? lock_b : lock_a);
+}
+static void fs_unlock_two(FS* fs, File* file_a, File* file_b) {
+	if(!fs->is_concurrent) return;
+	pthread_rwlock_t* lock_a = fs_get_lock(fs, file_a);
+	pthread_rwlock_t* lock_b = fs_get_lock(fs, file_b);
+	pthread_rwlock_unlock(lock_a);
+	if(lock_a != lock_b) pthread_rwlock_unlock(lock_b);
+}
+static int fs_get_locks(FS* fs, File** files, int files_size, pthread_rwlock_t** ret_locks) {
+	//sets ret_locks to the locks of files without repeats, in address order
+	int locks_size = 0;
+	for_each_lt(i, files_size) {
+		pthread_rwlock_t* lock = fs_get_lock(fs, files[i]);
+		int j = locks_size;
+		while(j > 0 && ret_locks[j - 1] > lock) {
+			j -= 1;
+		}
+		if(j > 0 && ret_locks[j - 1] == lock) continue;
+		memmove(&ret_locks[j + 1], &ret_locks[j], (locks_size - j)*sizeof(pthread_rwlock_t*));
+		ret_locks[j] = lock;
+		locks_size += 1;
+	}
+	return locks_size;
+}
+#define FS_LOCK_FILES_MAX 4
+static void fs_lock_files(FS* fs, File** files, int files_size) {
+	//like fs_lock_two, for up to FS_LOCK_FILES_MAX files
+	if(!fs->is_concurrent) return;
+	ASSERT(files_size <= FS_LOCK_FILES_MAX);
+	pthread_rwlock_t* locks[FS_LOCK_FILES_MAX];
+	int locks_size = fs_get_locks(fs, files, files_size, locks);
+	for_each_lt(i, locks_size) {
+		pthread_rwlock_wrlock(locks[i]);
+	}
+}
+static void fs_unlock_files(FS* fs, File** files, int files_size) {
+	if(!fs->is_concurrent) return;
+	pthread_rwlock_t* locks[FS_LOCK_FILES_MAX];
+	int locks_size = fs_get_locks(fs, files, files_size, locks);
+	for_each_lt(i, locks_size) {
+		pthread_rwlock_unlock(locks[i]);
+	}
+}
+static void fs_lock_cache(FS* fs) {
+	if(fs->is_concurrent) pthread_mutex_lock(&fs->cache_lock);
+}
+static void fs_unlock_cache(FS* fs) {
+	if(fs->is_concurrent) pthread_mutex_unlock(&fs->cache_lock);
+}
+static void fs_count(uint64* stat) {
+	__atomic_fetch_add(stat, 1, __ATOMIC_RELAXED);
+}
+static void fs_hand_out(FS* fs, File* file) {
+	//in concurrent mode a file could be evicted as soon as the lock is released, so the caller gets it pinned
+	if(fs->is_concurrent && file) fs_pin(file);
+}
+static void fs_take_back(FS* fs, File* file) {
+	//undoes fs_hand_out for a file that isn't handed out after all
+	if(fs->is_concurrent && file) fs_unpin(file);
+}
+
+static int fs_enter_lookup(FS* fs) {
+	//until fs_exit_lookup, nothing retired after this is freed, so the index and files of a pinned directory can be read
+	//without its lock. returns the count to pass to fs_exit_lookup
+	if(!fs->is_concurrent) return 0;
+	uint64 thread_hash = cast(uint64, pthread_self())*0x9E3779B97F4A7C15ull;
+	int i = (__atomic_load_n(&fs->lookup_epoch, __ATOMIC_SEQ_CST)&1)*FS_LOOKUP_STRIPES + (thread_hash >> 58);
+	__atomic_fetch_add(&fs->lookups[i].count, 1, __ATOMIC_SEQ_CST);
+	return i;
+}
+static void fs_exit_lookup(FS* fs, int i) {
+	if(fs->is_concurrent) __atomic_fetch_sub(&fs->lookups[i].count, 1, __ATOMIC_RELEASE);
+}
+static void fs_wait_lookups(FS* fs) {
+	//waits until every lookup that started before this was called has finished
+	//a lookup that counts itself after its side was seen empty started after whatever was retired had been unlinked
+	//but it may have read the epoch before the flip, so both sides are waited on, the old one first
+	//must be called with fs->cache_lock held, so only one thread flips the epoch at a time
+	for_each_lt(flip, 2) {
+		uint32 epoch = __atomic_fetch_add(&fs->lookup_epoch, 1, __ATOMIC_SEQ_CST);
+		LookupCount* counts = &fs->lookups[(epoch&1)*FS_LOOKUP_STRIPES];
+		for_each_lt(i, FS_LOOKUP_STRIPES) {
+			while(__atomic_load_n(&counts[i].count, __ATOMIC_SEQ_CST)) sched_yield();
+		}
+	}
+}
+static void fs_retire(FS* fs, void* mem, bool is_cached) {
+	//frees mem once no lookup can be reading it, see fs_reclaim
+	if(!fs->is_concurrent) {
+		if(is_cached) mam_pool_free(fs->dir_cache, mem);
+		else free(mem);
+		return;
+	}
+	pthread_mutex_lock(&fs->retired_lock);
+	if(fs->retired_size >= fs->retired_capacity) {
+		fs->retired_capacity = fs->retired_capacity ? 2*fs->retired_capacity : FS_RETIRED_MAX;
+		fs->retired = cast(Retired*, realloc(fs->retired, fs->retired_capacity*sizeof(Retired)));
+	}
+	fs->retired[fs->retired_size] = (Retired){mem, is_cached};
+	__atomic_store_n(&fs->retired_size, fs->retired_size + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&fs->retired_lock);
+}
+static void fs_reclaim(FS* fs, bool is_waiting) {
+	//frees everything retired, after waiting for the lookups that could be reading it unless is_waiting is 0
+	//must be called with fs->cache_lock held, or while no other call is running
+	pthread_mutex_lock(&fs->retired_lock);
+	Retired* retired = fs->retired;
+	int retired_size = fs->retired_size;
+	fs->retired = 0;
+	__atomic_store_n(&fs->retired_size, 0, __ATOMIC_RELAXED);
+	fs->retired_capacity = 0;
+	pthread_mutex_unlock(&fs->retired_lock);
+	if(!retired_size) {
+		free(retired);
+		return;
+	}
+	if(is_waiting) fs_wait_lookups(fs);
+	for_each_lt(i, retired_size) {
+		if(retired[i].is_cached) mam_pool_free(fs->dir_cache, retired[i].mem);
+		else free(retired[i].mem);
+	}
+	free(retired);
+}
+static bool fs_try_pin(File* file) {
+	//pins a file found without its parent's lock, fails if it is already being evicted
+	uint32 pins = __atomic_load_n(&file->pins, __ATOMIC_RELAXED);
+	while(!(pins & FILE_PINS_EVICTED)) {
+		if(__atomic_compare_exchange_n(&file->pins, &pins, pins + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 1;
+	}
+	return 0;
+}
+
+static void fs_index_put(DirIndex* index, File* file) {
+	//the slot is filled last, so a lookup without the lock either sees all of the file or nothing
+	uint32 mask = index->capacity - 1;
+	uint32 i = file->name_hash&mask;
+	while(index->files[i]) {
+		i = (i + 1)&mask;
+	}
+	__atomic_store_n(&index->files[i], file, __ATOMIC_RELEASE);
+	index->size += 1;
+}
+static void fs_index_publish(FS* fs, DirIndex** index_ptr, DirIndex* index) {
+	//lookups read the index without the lock in concurrent mode, so the old one is retired rather than freed
+	DirIndex* old_index = *index_ptr;
+	__atomic_store_n(index_ptr, index, __ATOMIC_RELEASE);
+	if(old_index) fs_retire(fs, old_index, 0);
+}
+static DirIndex* fs_index_alloc(uint32 files_size) {
+	uint32 capacity = DIR_INDEX_CAPACITY_MIN;
+	while(4*files_size > 3*capacity) capacity *= 2;
+	DirIndex* index = cast(DirIndex*, calloc(1, sizeof(DirIndex) + capacity*sizeof(File*)));
+	index->capacity = capacity;
+	return index;
+}
+static void fs_index_insert(FS* fs, DirIndex** index_ptr, File* file) {
+	DirIndex* index = *index_ptr;
+	if(!index || 4*(index->size + 1) > 3*index->capacity) {
+		//grow the table and reinsert everything
+		DirIndex* new_index = fs_index_alloc(index ? 2*index->size + 2 : 1);
+		if(index) {
+			for_each_lt(i, index->capacity) {
+				if(index->files[i]) fs_index_put(new_index, index->files[i]);
+			}
+		}
+		fs_index_put(new_index, file);
+		fs_index_publish(fs, index_ptr, new_index);
+		return;
+	}
+	fs_index_put(index, file);
+}
+static void fs_index_rebuild(FS* fs, File* dir) {
+	//files are only ever added to a table lookups can be reading, so removing them means publishing a new one
+	uint32 files_size = 0;
+	for(File* child = dir->head_child; child; child = child->next) {
+		files_size += 1;
+	}
+	DirIndex* index = 0;
+	if(files_size) {
+		index = fs_index_alloc(files_size);
+		for(File* child = dir->head_child; child; child = child->next) {
+			fs_index_put(index, child);
+		}
+	}
+	fs_index_publish(fs, &dir->index, index);
+}
+static void fs_index_remove(DirIndex* index, File* file) {
+	//only outside of concurrent mode, see fs_index_rebuild
+	uint32 mask = index->capacity - 1;
+	uint32 i = file->name_hash&mask;
+	while(index->files[i] != file) {
+		i = (i + 1)&mask;
+	}
+	//shift back every file after it that would no longer be found past the hole
+	uint32 j = i;
+	while(1) {
+		j = (j + 1)&mask;
+		if(!index->files[j]) break;
+		uint32 home = index->files[j]->name_hash&mask;
+		if(((j - home)&mask) >= ((j - i)&mask)) {
+			index->files[i] = index->files[j];
+			i = j;
+		}
+	}
+	index->files[i] = 0;
+	index->size -= 1;
+}
+static File* fs_index_find(DirIndex* index, const char* name, uint16 name_size, uint32 name_hash) {
+	if(!index) return 0;
+	uint32 mask = index->capacity - 1;
+	uint32 i = name_hash&mask;
+	while(1) {
+		File* file = __atomic_load_n(&index->files[i], __ATOMIC_ACQUIRE);
+		if(!file) break;
+		//the full name is only compared when the hash and the size already match
+		if(file->name_hash == name_hash && file->name_size == name_size && memcmp(fs_filename_text(file), name, name_size) == 0) {
+			return file;
+		}
+		i = (i + 1)&mask;
+	}
+	return 0;
+}
+
+static DirNegative* fs_negative_set(FS* fs, INodePid dir_pid, uint32 name_hash) {
+	//the low bits of FNV-1a are poorly mixed, so the set is taken from the top bits of a multiplicative hash
+	return &fs->negatives[DIR_NEGATIVES_WAYS*(((name_hash^dir_pid)*0x9E3779B97F4A7C15ull) >> (64 - DIR_NEGATIVES_BITS))];
+}
+static DirNegative* fs_negative_find(FS* fs, INodePid dir_pid, const char* name, uint16 name_size, uint32 name_hash) {
+	DirNegative* set = fs_negative_set(fs, dir_pid, name_hash);
+	for_each_lt(i, DIR_NEGATIVES_WAYS) {
+		DirNegative* negative = &set[i];
+		if(negative->name_size == name_size && negative->dir_pid == dir_pid && negative->name_hash == name_hash && memcmp(negative->name, name, name_size) == 0) {
+			return negative;
+		}
+	}
+	return 0;
+}
+static void fs_negative_insert(FS* fs, INodePid dir_pid, const char* name, uint16 name_size, uint32 name_hash) {
+	if(name_size > sizeof(((DirNegative*)0)->name)) return;
+	DirNegative* set = fs_negative_set(fs, dir_pid, name_hash);
+	DirNegative* negative = &set[name_hash%DIR_NEGATIVES_WAYS];
+	for_each_lt(i, DIR_NEGATIVES_WAYS) {
+		if(!set[i].name_size) {
+			negative = &set[i];
+			break;
+		}
+	}
+	negative->dir_pid = dir_pid;
+	negative->name_hash = name_hash;
+	negative->name_size = name_size;
+	memcpy(negative->name, name, name_size);
+}
+static void fs_negative_remove(FS* fs, INodePid dir_pid, const char* name, uint16 name_size, uint32 name_hash) {
+	//every way of giving a directory a new name has to call this
+	DirNegative* negative = fs_negative_find(fs, dir_pid, name, name_size, name_hash);
+	if(negative) negative->name_size = 0;
+}
+static void fs_negative_forget(FS* fs, INodePid dir_pid) {
+	//for a directory that is removed, since its pid can be given to a new one
+	for_each_lt(i, DIR_NEGATIVES_SIZE) {
+		if(fs->negatives[i].dir_pid == dir_pid) fs->negatives[i].name_size = 0;
+	}
+}
+
+static void fs_lru_remove(FS* fs, File* dir) {
+	if(dir->lru_prev) dir->lru_prev->lru_next = dir->lru_next;
+	else fs->lru_head = dir->lru_next;
+	if(dir->lru_next) dir->lru_next->lru_prev = dir->lru_prev;
+	else fs->lru_tail = dir->lru_prev;
+	dir->lru_prev = 0;
+	dir->lru_next = 0;
+}
+static void fs_touch_dir(FS* fs, File* dir) {
+	//moves dir to the front of the lru list
+	if(fs->is_concurrent) {
+		//every lookup would otherwise wait on the cache lock, so a directory is only moved once between evictions
+		//a directory is only taken off the list once an eviction has bumped the epoch and left it with no children
+		if(__atomic_load_n(&dir->lru_epoch, __ATOMIC_RELAXED) == __atomic_load_n(&fs->lru_epoch, __ATOMIC_RELAXED)) return;
+	}
+	fs_lock_cache(fs);
+	__atomic_store_n(&dir->lru_epoch, fs->lru_epoch, __ATOMIC_RELAXED);
+	if(fs->lru_head != dir) {
+		if(dir->lru_prev || fs->lru_tail == dir) fs_lru_remove(fs, dir);
+		dir->lru_next = fs->lru_head;
+		if(fs->lru_head) fs->lru_head->lru_prev = dir;
+		else fs->lru_tail = dir;
+		fs->lru_head = dir;
+	}
+	fs_unlock_cache(fs);
+}
+static void fs_free_file(FS* fs, File* file) {
+	//for a file no lookup has seen yet, see fs_evict_children for the rest
+	fs_lock_cache(fs);
+	if(file->name_size > FILE_NAME_INLINE) mam_pool_free(fs->dir_cache, file->name_long);
+	mam_pool_free(fs->dir_cache, file);
+	fs_unlock_cache(fs);
+}
+static bool fs_can_evict(FS* fs, File* file) {
+	//only a file that is clean and not in use can be evicted, and a directory only once its children are
+	//a file is only pinned from 0 under its parent's lock, which the eviction holds, or by fs_try_pin, which
+	//fails once the pins are swapped for FILE_PINS_EVICTED here, so nothing else is using it
+	if(__atomic_load_n(&file->pins, __ATOMIC_ACQUIRE) || file->head_child || file->changes || file->delayed) return 0;
+	if(file->flags & (FILE_IS_DIRTY | FILE_IS_NEW)) return 0;
+	if(!fs_is_dir(file) && file->tail && file->tail->is_dirty) return 0;
+	if(fs->is_concurrent) {
+		uint32 pins = 0;
+		return __atomic_compare_exchange_n(&file->pins, &pins, FILE_PINS_EVICTED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+	}
+	return 1;
+}
+static bool fs_evict_children(FS* fs, File* dir) {
+	//evicts every child of dir that can be, the rest stay cached; returns 0 if none could be
+	if(dir->flags & DIR_IS_RESTORING) return 0;
+	__atomic_store_n(&fs->lru_epoch, fs->lru_epoch + 1, __ATOMIC_RELAXED);
+	uint64 evicted_size = 0;
+	File** link = &dir->head_child;
+	while(*link) {
+		File* child = *link;
+		if(!fs_can_evict(fs, child)) {
+			link = &child->next;
+			continue;
+		}
+		*link = child->next;
+		if(!fs->is_concurrent) fs_index_remove(dir->index, child);
+		if(child->lru_prev || fs->lru_tail == child) fs_lru_remove(fs, child);
+		if(!fs_is_dir(child)) free(child->tail);
+		free(child->index);
+		//lookups without the lock may still be reading the child's name
+		if(child->name_size > FILE_NAME_INLINE) fs_retire(fs, child->name_long, 1);
+		fs_retire(fs, child, 1);
+		evicted_size += 1;
+	}
+	if(evicted_size) {
+		dir->flags &= ~DIR_IS_CACHED;
+		fs->cache_evictions += 1;
+		fs->cache_files_evicted += evicted_size;
+		if(fs->is_concurrent) fs_index_rebuild(fs, dir);
+	}
+	if(!dir->head_child) {
+		fs_index_publish(fs, &dir->index, 0);
+		fs_lru_remove(fs, dir);
+	}
+	return evicted_size > 0;
+}
+static bool fs_evict_lru(FS* fs, File* parent) {
+	//evicts the children of the least recently used directory that has any that can be, returns 0 if none does
+	//in concurrent mode the directories other threads are using are skipped, unless their lock is the one of parent,
+	//which the calling thread holds for writing
+	File* dir = fs->lru_tail;
+	while(dir) {
+		File* prev = dir->lru_prev;
+		bool is_held = fs->is_concurrent && parent && fs_get_lock(fs, dir) == fs_get_lock(fs, parent);
+		if(is_held || fs_try_lock_write(fs, dir)) {
+			bool is_evicted = fs_evict_children(fs, dir);
+			if(!is_held) fs_unlock(fs, dir);
+			if(is_evicted) return 1;
+		}
+		dir = prev;
+	}
+	return 0;
+}
+#define FS_EVICT_TRIES 64
+static void* fs_cache_alloc(FS* fs, File* parent) {
+	//files and the names too long to fit in them share the pool; returns 0 if nothing can be evicted to make room
+	//parent is the directory the memory is for, in concurrent mode the caller must hold its write lock
+	fs_lock_cache(fs);
+	if(__atomic_load_n(&fs->retired_size, __ATOMIC_RELAXED) >= FS_RETIRED_MAX) fs_reclaim(fs, 1);
+	void* mem = 0;
+	int tries = 0;
+	while(1) {
+		if(!mam_pool_will_overflow(fs->dir_cache)) {
+			mem = mam_pool_allocn(fs->dir_cache);
+			break;
+		}
+		if(fs_evict_lru(fs, parent)) {
+			fs_reclaim(fs, 1);
+			continue;
+		}
+		//the directories that could be evicted from may only be busy for a moment
+		if(!fs->is_concurrent || tries >= FS_EVICT_TRIES) break;
+		tries += 1;
+		fs_unlock_cache(fs);
+		sched_yield();
+		fs_lock_cache(fs);
+	}
+	fs_unlock_cache(fs);
+	return mem;
+}
+static char* fs_alloc_filename(FS* fs, File* file, uint16 name_size, File* parent) {
+	//returns where a name of name_size is kept once fs_put_filename is called, or 0 if there is no room in the dir cache
+	//parent is the directory whose lock the caller holds, if any, see fs_cache_alloc
+	if(name_size <= FILE_NAME_INLINE) return file->name_inline;
+	if(file->name_size > FILE_NAME_INLINE) return file->name_long;
+	//the file could otherwise be evicted to make room for its own name
+	fs_pin(file);
+	char* text = cast(char*, fs_cache_alloc(fs, parent));
+	fs_unpin(file);
+	return text;
+}
+static void fs_put_filename(FS* fs, File* file, char* text, const char* name, uint16 name_size) {
+	//NOTE: the index of the parent directory is keyed by the name's hash, it is not updated here
+	bool was_long = file->name_size > FILE_NAME_INLINE;
+	char* old_text = file->name_long;
+	memmove(text, name, name_size);
+	if(was_long && name_size <= FILE_NAME_INLINE) fs_retire(fs, old_text, 1);
+	if(name_size > FILE_NAME_INLINE) file->name_long = text;
+	file->name_size = name_size;
+	file->name_hash = fs_hash_filename(FS_HASH_SEED, name, name_size);
+}
+static bool fs_set_filename_(FS* fs, File* file, const char* name, uint16 name_size, File* parent) {
+	//fails if the name is too long, or if there is no room in the dir cache for it
+	if(name_size > FS_NAME_MAX) return 0;
+	char* text = fs_alloc_filename(fs, file, name_size, parent);
+	if(!text) return 0;
+	fs_put_filename(fs, file, text, name, name_size);
+	return 1;
+}
+
+static void fs_free_index_(File* dir) {
+	for(File* child = dir->head_child; child; child = child->next) {
+		fs_free_index_(child);
+	}
+	free(dir->index);
+	dir->index = 0;
+}
+
+static bool fs_init_file(FS* fs, File* file, const char* name, uint16 name_size, uint16 status, File* parent) {
 	file->head_child = 0;
 	file->next = 0;
+	file->delayed = 0;
+	file->tail = 0;
+	file->index = 0;
+	file->changes = 0;
+	file->lru_prev = 0;
+	file->lru_next = 0;
+	file->lru_epoch = 0;
+	file->pins = 0;
 	file->flags = (status == INODE_DIR) ? DIR_IS_CACHED : 0;
+	file->name_size = 0;
+	if(!fs_set_filename_(fs, file, name, name_size, parent)) return 0;
 
 	//TODO: eliminate this call so this function never fails
 	if(!inode_create(&fs->device, &fs->inode_a, 0, &file->inode)) return 0;
 	file->inode.status = status;
-
-	file->name = 0;
-	fs_set_filename(fs, file, name, name_size);
 	return 1;
 }
 
+static void fs_set_dirty(FS* fs, File* file) {
+	//the file's lock is held, the first change since the last save puts it on fs->dirty
+	if(file->flags & FILE_IS_DIRTY) return;
+	file->flags |= FILE_IS_DIRTY;
+	fs_lock_cache(fs);
+	file->dirty_next = fs->dirty;
+	fs->dirty = file;
+	fs->dirty_size += 1;
+	fs_unlock_cache(fs);
+}
+static void fs_add_change(FS* fs, File* dir, uint32 hash, INodePid pid, File* file) {
+	DirChanges* changes = dir->changes;
+	if(!changes || changes->size >= changes->capacity) {
+		int capacity = changes ? 2*changes->capacity : 16;
+		changes = cast(DirChanges*, realloc(changes, sizeof(DirChanges) + capacity*sizeof(DirChange)));
+		if(!dir->changes) changes->size = 0;
+		changes->capacity = capacity;
+		dir->changes = changes;
+	}
+	DirChange* change = &changes->changes[changes->size];
+	changes->size += 1;
+	change->hash = hash;
+	change->pid = pid;
+	change->file = file;
+	change->unlinked = 0;
+	change->is_moved = 0;
+	fs_set_dirty(fs, dir);
+}
+static DirChange* fs_detach_child(FS* fs, File* dir, File* child, bool is_moved) {
+	//takes child out of dir, its entry is removed from the directory's file when dir is next saved
+	//is_moved if child keeps living under another entry, whose add then has to be saved first
+	//returns the removal, or 0 if child never got an entry
+	File** link = &dir->head_child;
+	while(*link != child) {
+		link = &(*link)->next;
+	}
+	*link = child->next;
+	child->next = 0;
+	if(fs->is_concurrent) fs_index_rebuild(fs, dir);
+	else fs_index_remove(dir->index, child);
+	if(child->flags & FILE_IS_NEW) {
+		//it never got an entry, so just forget the one that was going to be added
+		DirChanges* changes = dir->changes;
+		for_each_lt(i, changes->size) {
+			if(changes->changes[i].file == child) {
+				changes->size -= 1;
+				changes->changes[i] = changes->changes[changes->size];
+				break;
+			}
+		}
+		child->flags &= ~FILE_IS_NEW;
+		//unless a save that failed wrote it anyway
+		if(!(dir->flags & DIR_IS_SAVE_FAILED)) return 0;
+	}
+	fs_add_change(fs, dir, child->name_hash, child->inode.pid, 0);
+	DirChange* change = &dir->changes->changes[dir->changes->size - 1];
+	change->is_moved = is_moved;
+	return change;
+}
 static File* fs_create_file(FS* fs, File* parent, const char* name, uint16 name_size, uint16 status) {
 	//TODO: properly handle these asserts
 	ASSERT(name_size > 0);
-	if(!name_size) return 0;
+	if(!name_size || name_size > FS_NAME_MAX) return 0;
 	if(parent->inode.status != INODE_DIR || (name_size == 0)) return 0;
 	//TODO: consider rounding the filename size?
 	// name_size = sizeof(INodePid)*((name_size + sizeof(INodePid) - 1)/sizeof(INodePid));
-	//TODO: handle eviction policy
-	File* new_child = mam_pool_alloc(File, fs->dir_cache);
-	if(!fs_init_file(fs, new_child, name, name_size, status)) return 0;
+	fs_touch_dir(fs, parent);
+	fs_pin(parent);
+	File* new_child = cast(File*, fs_cache_alloc(fs, parent));
+	bool ok = new_child && fs_init_file(fs, new_child, name, name_size, status, parent);
+	fs_unpin(parent);
+	if(!ok) {
+		//NOTE: the inode is leaked if only it failed
+		if(new_child) fs_free_file(fs, new_child);
+		return 0;
+	}
+	//the status set by fs_init_file is only saved with the inode
+	new_child->flags |= FILE_IS_NEW;
+	fs_set_dirty(fs, new_child);
+	fs_lock_cache(fs);
+	fs_negative_remove(fs, parent->inode.pid, name, name_size, new_child->name_hash);
+	fs_unlock_cache(fs);
 	//add new child to the directory's children list
 	//TODO: handle children with the same name
 	new_child->next = parent->head_child;
 	parent->head_child = new_child;
-	parent->flags |= FILE_IS_DIRTY;
+	fs_index_insert(fs, &parent->index, new_child);
+	fs_add_change(fs, parent, new_child->name_hash, new_child->inode.pid, new_child);
 	return new_child;
 }
-static bool fs_save_dir(FS* fs, File* dir) {
-	ASSERT(dir->inode.status == INODE_DIR);
+static int fs_find_delayed(DelayedData* delayed, int64 block_offset) {
+	//binary search, returns the index block_offset is at or would be inserted at
+	int lo = 0;
+	int hi = delayed->blocks_size;
+	while(lo < hi) {
+		int mid = (lo + hi)/2;
+		if(delayed->blocks[mid].block_offset < block_offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+static int64 fs_get_delayed_reserve(int64 block_offset, int block_size) {
+	//the block, and roughly one pointer block for every block of pids it could need
+	return (block_offset%(block_size/sizeof(BlockPid)) == 0) ? 2 : 1;
+}
+static byte* fs_get_delayed_block(FS* fs, File* file, int64 block_offset) {
+	//returns the memory holding the given block of the file, reserving space for it if it is new
+	int block_size = fs->device.block_size;
+	DelayedData* delayed = file->delayed;
+	if(!delayed) {
+		delayed = cast(DelayedData*, malloc(sizeof(DelayedData) + 16*sizeof(DelayedBlock)));
+		delayed->blocks_reserved = 0;
+		delayed->blocks_size = 0;
+		delayed->blocks_capacity = 16;
+		file->delayed = delayed;
+	}
+	int i = fs_find_delayed(delayed, block_offset);
+	if(i < delayed->blocks_size && delayed->blocks[i].block_offset == block_offset) {
+		return delayed->blocks[i].mem;
+	}
+	int64 reserve_size = fs_get_delayed_reserve(block_offset, block_size);
+	if(!block_reserve(&fs->device, reserve_size)) return 0;
+	delayed->blocks_reserved += reserve_size;
+	if(delayed->blocks_size >= delayed->blocks_capacity) {
+		delayed->blocks_capacity *= 2;
+		delayed = cast(DelayedData*, realloc(delayed, sizeof(DelayedData) + delayed->blocks_capacity*sizeof(DelayedBlock)));
+		file->delayed = delayed;
+	}
+	memmove(&delayed->blocks[i + 1], &delayed->blocks[i], (delayed->blocks_size - i)*sizeof(DelayedBlock));
+	delayed->blocks_size += 1;
+	delayed->blocks[i].block_offset = block_offset;
+	delayed->blocks[i].mem = cast(byte*, calloc(1, block_size));
+	fs->delayed_blocks_size += 1;
+	return delayed->blocks[i].mem;
+}
+static void fs_free_delayed(FS* fs, File* file) {
+	DelayedData* delayed = file->delayed;
+	for_each_lt(i, delayed->blocks_size) {
+		free(delayed->blocks[i].mem);
+	}
+	block_unreserve(&fs->device, delayed->blocks_reserved);
+	fs->delayed_blocks_size -= delayed->blocks_size;
+	free(delayed);
+	file->delayed = 0;
+}
+static bool fs_flush_delayed(FS* fs, File* file) {
+	//allocates data blocks for everything held in memory for the file and writes it out
+	DelayedData* delayed = file->delayed;
+	if(!delayed) return 1;
+	file->writes += 1;
+	BlockDevice* device = &fs->device;
+	int block_size = device->block_size;
+	//the reservation is handed back first so the allocations below can use it
+	block_unreserve(device, delayed->blocks_reserved);
+	delayed->blocks_reserved = 0;
+	bool ok = 1;
+	int i = 0;
+	while(ok && i < delayed->blocks_size) {
+		//find the run of consecutive blocks of the file starting at i
+		int run = 1;
+		while(i + run < delayed->blocks_size && delayed->blocks[i + run].block_offset == delayed->blocks[i].block_offset + run) {
+			run += 1;
+		}
+		//give it as few runs of consecutive data blocks as the device allows
+		byte* run_mem = cast(byte*, malloc(run*block_size));
+		BlockPid* run_pids = cast(BlockPid*, malloc(run*sizeof(BlockPid)));
+		int j = 0;
+		while(ok && j < run) {
+			int64 alloc_size;
+			BlockPid pid = block_alloc_run(device, run - j, &alloc_size);
+			if(!pid) {
+				ok = 0;
+				break;
+			}
+			for_each_lt(k, alloc_size) {
+				memcpy(&run_mem[k*block_size], delayed->blocks[i + j + k].mem, block_size);
+				run_pids[k] = pid + k;
+			}
+			//the data is written before the inode refers to it
+			if(!block_write_run(device, pid, alloc_size, run_mem)) {
+				for_each_lt(k, alloc_size) block_free(device, pid + k);
+				ok = 0;
+				break;
+			}
+			ok = inode_set_blocks(device, &file->inode, delayed->blocks[i + j].block_offset, alloc_size, run_pids);
+			if(!ok) break;
+			for_each_lt(k, alloc_size) {
+				free(delayed->blocks[i + j + k].mem);
+				delayed->blocks[i + j + k].mem = 0;
+			}
+			j += alloc_size;
+		}
+		free(run_mem);
+		free(run_pids);
+		i += run;
+	}
+	if(ok) {
+		fs_free_delayed(fs, file);
+		return 1;
+	}
+	//the blocks that didn't make it to the device are kept and reserved again, so the next save tries them again
+	//instead of the file reading zeros where they were
+	int kept_size = 0;
+	int64 reserve_size = 0;
+	for_each_lt(k, delayed->blocks_size) {
+		if(!delayed->blocks[k].mem) continue;
+		delayed->blocks[kept_size] = delayed->blocks[k];
+		kept_size += 1;
+		reserve_size += fs_get_delayed_reserve(delayed->blocks[k].block_offset, block_size);
+	}
+	fs->delayed_blocks_size -= delayed->blocks_size - kept_size;
+	delayed->blocks_size = kept_size;
+	if(block_reserve(device, reserve_size)) delayed->blocks_reserved = reserve_size;
+	return 0;
+}
+static bool fs_flush_all_delayed_(FS* fs, File* dir) {
 	File* cur_child = dir->head_child;
-	uint64 cur_offset = 0;
 	while(cur_child) {
-		DirEntryHeader header = {cur_child->inode.pid, cur_child->name_size};
-		if(!inode_write(&fs->device, &dir->inode, cur_offset, &header, SIZEOF_HEADER)) return 0;
-		cur_offset += SIZEOF_HEADER;
-		//write the name immediately after
-		Filename* cur_filename = cur_child->name;
-		uint cur_left = cur_child->name_size;
-		while(cur_left > FILENAME_TEXT_SIZE) {
-			if(!inode_write(&fs->device, &dir->inode, cur_offset, &cur_filename->text, FILENAME_TEXT_SIZE)) return 0;
-			cur_offset += FILENAME_TEXT_SIZE;
-			cur_left -= FILENAME_TEXT_SIZE;
-			cur_filename = cur_filename->next;
-		}
-		if(!inode_write(&fs->device, &dir->inode, cur_offset, &cur_filename->text, cur_left)) return 0;
-		cur_offset += cur_left;
-		//move on
+		if(cur_child->inode.status == INODE_DIR) {
+			if(!fs_flush_all_delayed_(fs, cur_child)) return 0;
+		} else if(!fs_flush_delayed(fs, cur_child)) return 0;
 		cur_child = cur_child->next;
 	}
-	if(!inode_set_size(&fs->device, &dir->inode, cur_offset)) return 0;
-	dir->flags &= ~FILE_IS_DIRTY;
-	if(!inode_save(&fs->device, &dir->inode)) return 0;
 	return 1;
 }
+static bool fs_write_delayed(FS* fs, File* file, uint64 mem_offset, const void* mem, uint64 mem_size) {
+	BlockDevice* device = &fs->device;
+	INode* inode = &file->inode;
+	if(mem_offset + mem_size < mem_size) {ASSERT(0); return 0;}//catch overflows
+	if(!mem_size) return 1;
+	if(mem_offset + mem_size > inode->mem_size) {
+		if(!inode_set_size(device, inode, mem_offset + mem_size)) return 0;
+	}
+	if(inode->flags & INODE_IS_INLINE) {
+		//the data still fits in the inode, so there is nothing to allocate
+		return inode_write(device, inode, mem_offset, mem, mem_size);
+	}
+	int block_size = device->block_size;
+	int64 block_offset = mem_offset/block_size;
+	int64 blocks_size = (mem_offset + mem_size + block_size - 1)/block_size - block_offset;
+	BlockPid* pids = cast(BlockPid*, malloc(blocks_size*sizeof(BlockPid)));
+	bool ok = inode_get_blocks(device, inode, block_offset, blocks_size, pids);
+	const byte* cur_mem = cast(const byte*, mem);
+	uint64 cur_offset = mem_offset;
+	uint64 mem_left_size = mem_size;
+	int64 i = 0;
+	while(ok && i < blocks_size) {
+		uint64 cur_size;
+		if(pids[i]) {
+			//blocks that already exist are written through, a run at a time
+			int64 run = 1;
+			while(i + run < blocks_size && pids[i + run]) run += 1;
+			cur_size = (block_offset + i + run)*block_size - cur_offset;
+			if(cur_size > mem_left_size) cur_size = mem_left_size;
+			ok = inode_write(device, inode, cur_offset, cur_mem, cur_size);
+			i += run;
+		} else {
+			int internal_offset = cur_offset%block_size;
+			cur_size = block_size - internal_offset;
+			if(cur_size > mem_left_size) cur_size = mem_left_size;
+			byte* block_mem = fs_get_delayed_block(fs, file, block_offset + i);
+			if(block_mem) {
+				memcpy(&block_mem[internal_offset], cur_mem, cur_size);
+			} else ok = 0;
+			i += 1;
+		}
+		cur_mem += cur_size;
+		cur_offset += cur_size;
+		mem_left_size -= cur_size;
+	}
+	free(pids);
+	if(ok && fs->delayed_blocks_size > FS_DELAYED_BLOCKS_MAX) {
+		ok = fs_flush_delayed(fs, file);
+	}
+	return ok;
+}
+static void fs_read_delayed(FS* fs, File* file, uint64 mem_offset, void* mem, uint64 mem_size) {
+	//copies the blocks held in memory for the file over what was read from the device
+	DelayedData* delayed = file->delayed;
+	int block_size = fs->device.block_size;
+	uint64 mem_end = mem_offset + mem_size;
+	for(int i = fs_find_delayed(delayed, mem_offset/block_size); i < delayed->blocks_size; i += 1) {
+		uint64 block_begin = delayed->blocks[i].block_offset*block_size;
+		if(block_begin >= mem_end) break;
+		uint64 copy_begin = (block_begin > mem_offset) ? block_begin : mem_offset;
+		uint64 copy_end = (block_begin + block_size < mem_end) ? block_begin + block_size : mem_end;
+		memcpy(ptr_add(byte, mem, copy_begin - mem_offset), &delayed->blocks[i].mem[copy_begin - block_begin], copy_end - copy_begin);
+	}
+}
 
-static bool fs_save_all_(FS* fs, File* dir) {
-	//TODO: inline save_dir to only visit each node once?
-	if(dir->flags & FILE_IS_DIRTY) {
-		if(!fs_save_dir(fs, dir)) return 0;
+static bool fs_is_path_shared(BlockDevice* device, const INodeCursor* cursor) {
+	//a clone only adds a reference to the top of the tree, so every block below a shared pointer block is shared too
+	if(!device->refs_size) return 0;
+	for(int level = 0; level <= cursor->level; level += 1) {
+		BlockPid pid = cursor->block_path_pids[level] & ~INODE_UNWRITTEN;
+		if(pid && block_get_refs(device, pid) > 1) return 1;
 	}
-	File* cur_child = dir->head_child;
-	while(cur_child) {
-		if(cur_child->inode.status == INODE_DIR) {
-			if(!fs_save_all_(fs, cur_child)) return 0;
-		} else if(cur_child->flags & FILE_IS_DIRTY) {
-			cur_child->flags &= ~FILE_IS_DIRTY;
-			if(!inode_save(&fs->device, &cur_child->inode)) return 0;
+	return 0;
+}
+static bool fs_flush_tail(FS* fs, File* file) {
+	FileTail* tail = file->tail;
+	if(!tail || !tail->is_dirty) return 1;
+	file->writes += 1;
+	BlockDevice* device = &fs->device;
+	BlockPid pid = tail->cursor.block_path_pids[0];
+	bool is_shared = fs_is_path_shared(device, &tail->cursor);
+	if(pid & INODE_UNWRITTEN) {
+		//the block was preallocated, it is marked written only once it is
+		pid &= ~INODE_UNWRITTEN;
+		if(!is_shared) {
+			if(!block_write(device, pid, tail->mem)) return 0;
+			if(!inode_cursor_set_pid(device, &file->inode, &tail->cursor, pid)) return 0;
+			tail->is_dirty = 0;
+			return 1;
 		}
-		//move on
-		cur_child = cur_child->next;
 	}
+	if(!pid || is_shared) {
+		//the block is given to the file only once it is written, so it never needs to be zeroed
+		//a block shared with a clone is replaced the same way, since the tail already holds all of its contents
+		//the pointer blocks above it are copied by inode_cursor_set_pid
+		pid = block_alloc(device);
+		if(!pid) return 0;
+		if(!inode_cursor_set_pid(device, &file->inode, &tail->cursor, pid)) return 0;
+	}
+	if(!block_write(device, pid, tail->mem)) return 0;
+	tail->is_dirty = 0;
 	return 1;
 }
+static bool fs_drop_tail(FS* fs, File* file) {
+	//called before the file is changed other than by fs_append, since the tail may no longer be the last block
+	bool ok = fs_flush_tail(fs, file);
+	free(file->tail);
+	file->tail = 0;
+	return ok;
+}
 
-static bool fs_restore_dir(FS* fs, File* dir) {
-	ASSERT(dir->inode.status == INODE_DIR);
-	if(dir->flags & DIR_IS_CACHED) return 1;
+static bool fs_dir_read_node(FS* fs, File* dir, uint32 node, byte* mem) {
+	return inode_read(&fs->device, &dir->inode, cast(uint64, node)*DIR_NODE_SIZE, mem, DIR_NODE_SIZE);
+}
+static bool fs_dir_write_node(FS* fs, File* dir, uint32 node, const byte* mem) {
+	return inode_write(&fs->device, &dir->inode, cast(uint64, node)*DIR_NODE_SIZE, mem, DIR_NODE_SIZE);
+}
+static uint32 fs_dir_record_size(const byte* mem, uint32 offset) {
+	if(cast(const DirNodeHeader*, mem)->level) return sizeof(DirBranch);
+	DirEntryHeader entry;
+	memcpy(&entry, mem + offset, SIZEOF_HEADER);
+	return SIZEOF_HEADER + entry.name_size;
+}
+static uint32 fs_dir_record_hash(const byte* mem, uint32 offset) {
+	if(cast(const DirNodeHeader*, mem)->level) return ptr_add(const DirBranch, mem, offset)->hash;
+	DirEntryHeader entry;
+	memcpy(&entry, mem + offset, SIZEOF_HEADER);
+	return entry.hash;
+}
 
-	uint64 cur_offset = 0;
-	uint64 cur_left = dir->inode.mem_size;
-	//NOTE: this function will fail horribly if the dir is corrupted, maybe fix?
-	dir->head_child = 0;
-	while(cur_offset < cur_left) {
-		DirEntryHeader header;
-		if(!inode_read(&fs->device, &dir->inode, cur_offset, &header, SIZEOF_HEADER)) return 0;
-		cur_offset += SIZEOF_HEADER;
-		{//cache the new file
-			File* new_file = mam_pool_alloc(File, fs->dir_cache);
-			new_file->head_child = 0;
-			//NOTE: the flags here are initialized to 0
-			new_file->flags = 0;
-			if(!inode_restore(&fs->device, header.pid, &new_file->inode)) return 0;
-
-			{//copy the filename into the dir cache
-				Filename* cur_filename = mam_pool_alloc(Filename, fs->dir_cache);
-				new_file->name = cur_filename;
-				new_file->name_size = header.name_size;
-
-				int cur_text_left = header.name_size;
-				while(cur_text_left > FILENAME_TEXT_SIZE) {
-					if(!inode_read(&fs->device, &dir->inode, cur_offset, &cur_filename->text, FILENAME_TEXT_SIZE)) return 0;
-					cur_offset += FILENAME_TEXT_SIZE;
-					cur_text_left -= FILENAME_TEXT_SIZE;
-					//create another filename array
-					cur_filename->next = mam_pool_alloc(Filename, fs->dir_cache);
-					cur_filename = cur_filename->next;
+static bool fs_dir_descend(FS* fs, File* dir, uint32 hash, DirPath* path) {
+	//reads the path down to the first leaf that can hold hash, entries with hash can continue into the leaves after it
+	//the directory must not be empty
+	path->low = -1;
+	path->bound = cast(uint64, 1)<<32;
+	uint32 node = 0;
+	for_each_lt(depth, DIR_LEVEL_MAX) {
+		byte* mem = path->mem[depth];
+		if(!fs_dir_read_node(fs, dir, node, mem)) return 0;
+		path->nodes[depth] = node;
+		DirNodeHeader* header = cast(DirNodeHeader*, mem);
+		if(!header->level) {
+			//stop at the first entry not below hash
+			uint32 offset = sizeof(DirNodeHeader);
+			while(offset < header->mem_size && fs_dir_record_hash(mem, offset) < hash) {
+				offset += fs_dir_record_size(mem, offset);
+			}
+			path->depth = depth;
+			path->offsets[depth] = offset;
+			return 1;
+		}
+		//binary search for the last branch below hash, or the first branch
+		DirBranch* branches = ptr_add(DirBranch, mem, sizeof(DirNodeHeader));
+		int lo = 1;
+		int hi = header->records_size;
+		while(lo < hi) {
+			int mid = (lo + hi)/2;
+			if(branches[mid].hash < hash) lo = mid + 1;
+			else hi = mid;
+		}
+		if(lo > 1) path->low = branches[lo - 1].hash;
+		if(lo < header->records_size) path->bound = branches[lo].hash;
+		path->offsets[depth] = sizeof(DirNodeHeader) + (lo - 1)*sizeof(DirBranch);
+		node = branches[lo - 1].node;
+	}
+	//the tree can't be this deep unless it is corrupted
+	return 0;
+}
+static bool fs_dir_find(FS* fs, File* dir, const char* name, uint16 name_size, uint32 hash, DirPath* path, const byte** ret_entry) {
+	//points ret_entry at the entry for name in path, or at 0 if there is none
+	*ret_entry = 0;
+	if(!dir->inode.mem_size) return 1;
+	if(!fs_dir_descend(fs, dir, hash, path)) return 0;
+	byte* mem = path->mem[path->depth];
+	DirNodeHeader* header = cast(DirNodeHeader*, mem);
+	uint32 offset = path->offsets[path->depth];
+	while(1) {
+		while(offset < header->mem_size) {
+			DirEntryHeader entry;
+			memcpy(&entry, mem + offset, SIZEOF_HEADER);
+			if(entry.hash != hash) return 1;
+			if(entry.name_size == name_size && memcmp(mem + offset + SIZEOF_HEADER, name, name_size) == 0) {
+				*ret_entry = mem + offset;
+				return 1;
+			}
+			offset += SIZEOF_HEADER + entry.name_size;
+		}
+		//only a run of equal hashes can continue into the next leaf
+		if(path->bound != hash || !header->next) return 1;
+		path->nodes[path->depth] = header->next;
+		if(!fs_dir_read_node(fs, dir, header->next, mem)) return 0;
+		offset = sizeof(DirNodeHeader);
+	}
+}
+static uint32 fs_dir_leaf_offset(const byte* mem, uint32 hash) {
+	//the offset of the first entry of the leaf not below hash
+	const DirNodeHeader* header = cast(const DirNodeHeader*, mem);
+	uint32 offset = sizeof(DirNodeHeader);
+	while(offset < header->mem_size && fs_dir_record_hash(mem, offset) < hash) {
+		offset += fs_dir_record_size(mem, offset);
+	}
+	return offset;
+}
+static void fs_dir_node_insert(byte* mem, uint32 offset, const byte* record, uint32 record_size) {
+	DirNodeHeader* header = cast(DirNodeHeader*, mem);
+	memmove(mem + offset + record_size, mem + offset, header->mem_size - offset);
+	memcpy(mem + offset, record, record_size);
+	header->mem_size += record_size;
+	header->records_size += 1;
+}
+static void fs_dir_fill_node(byte* mem, uint16 level, const byte* records, uint32 records_mem_size, uint16 records_size, uint32 next) {
+	memset(mem, 0, DIR_NODE_SIZE);
+	DirNodeHeader* header = cast(DirNodeHeader*, mem);
+	header->level = level;
+	header->records_size = records_size;
+	header->mem_size = sizeof(DirNodeHeader) + records_mem_size;
+	header->next = next;
+	memcpy(mem + sizeof(DirNodeHeader), records, records_mem_size);
+}
+static bool fs_dir_split(FS* fs, File* dir, DirPath* path, byte* record, uint32 record_size) {
+	//inserts the record at offsets[depth] of the leaf of path, which it doesn't fit in, and writes every node changed
+	//each full node is split in half, which adds a branch to its parent; the root stays at node 0
+	for(int depth = path->depth; depth >= 0; depth -= 1) {
+		byte* mem = path->mem[depth];
+		DirNodeHeader* header = cast(DirNodeHeader*, mem);
+		uint32 offset = path->offsets[depth];
+		//a new branch goes right after the branch to the child that was split
+		if(depth < path->depth) offset += sizeof(DirBranch);
+		if(header->mem_size + record_size <= DIR_NODE_SIZE) {
+			fs_dir_node_insert(mem, offset, record, record_size);
+			return fs_dir_write_node(fs, dir, path->nodes[depth], mem);
+		}
+		//lay out the overfull node in split_mem, and cut it at the first record past the middle
+		byte* split_mem = path->split_mem;
+		memcpy(split_mem, mem, offset);
+		memcpy(split_mem + offset, record, record_size);
+		memcpy(split_mem + offset + record_size, mem + offset, header->mem_size - offset);
+		DirNodeHeader split_header = *header;
+		split_header.mem_size += record_size;
+		split_header.records_size += 1;
+		uint32 middle = sizeof(DirNodeHeader) + (split_header.mem_size - sizeof(DirNodeHeader))/2;
+		uint32 split_offset = sizeof(DirNodeHeader);
+		uint16 left_records_size = 0;
+		while(split_offset < middle) {
+			split_offset += fs_dir_record_size(split_mem, split_offset);
+			left_records_size += 1;
+		}
+		ASSERT(split_offset < split_header.mem_size);
+		uint32 left_node = path->nodes[depth];
+		uint32 right_node = cast(uint32, dir->inode.mem_size/DIR_NODE_SIZE);
+		if(depth == 0) {
+			//the halves of the root both move to new nodes, and the root becomes the branch node over them
+			left_node = right_node;
+			right_node += 1;
+		}
+		//a new node is written before any node that links to it, so a write that fails leaves every leaf reachable
+		//the halves of the root are both new, and are only linked to once the root is written
+		uint16 right_records_size = split_header.records_size - left_records_size;
+		uint32 right_mem_size = split_header.mem_size - split_offset;
+		if(depth) {
+			fs_dir_fill_node(mem, split_header.level, split_mem + split_offset, right_mem_size, right_records_size, split_header.next);
+			if(!fs_dir_write_node(fs, dir, right_node, mem)) return 0;
+		}
+		uint32 left_next = split_header.level ? 0 : right_node;
+		fs_dir_fill_node(mem, split_header.level, split_mem + sizeof(DirNodeHeader), split_offset - sizeof(DirNodeHeader), left_records_size, left_next);
+		if(!fs_dir_write_node(fs, dir, left_node, mem)) return 0;
+		if(!depth) {
+			fs_dir_fill_node(mem, split_header.level, split_mem + split_offset, right_mem_size, right_records_size, split_header.next);
+			if(!fs_dir_write_node(fs, dir, right_node, mem)) return 0;
+		}
+
+		DirBranch branch = {fs_dir_record_hash(split_mem, split_offset), right_node};
+		if(depth == 0) {
+			memset(mem, 0, DIR_NODE_SIZE);
+			header->level = split_header.level + 1;
+			header->records_size = 2;
+			header->mem_size = sizeof(DirNodeHeader) + 2*sizeof(DirBranch);
+			header->removed_size = split_header.removed_size;
+			DirBranch* branches = ptr_add(DirBranch, mem, sizeof(DirNodeHeader));
+			branches[0].hash = fs_dir_record_hash(split_mem, sizeof(DirNodeHeader));
+			branches[0].node = left_node;
+			branches[1] = branch;
+			return fs_dir_write_node(fs, dir, 0, mem);
+		}
+		memcpy(record, &branch, sizeof(DirBranch));
+		record_size = sizeof(DirBranch);
+	}
+	return 0;
+}
+static bool fs_dir_has_entry(const byte* mem, uint32 offset, uint32 hash, INodePid pid) {
+	//whether the leaf has the entry with hash and pid, looking from the offset of the first entry not below hash
+	const DirNodeHeader* header = cast(const DirNodeHeader*, mem);
+	while(offset < header->mem_size && fs_dir_record_hash(mem, offset) == hash) {
+		DirEntryHeader entry;
+		memcpy(&entry, mem + offset, SIZEOF_HEADER);
+		if(entry.pid == pid) return 1;
+		offset += SIZEOF_HEADER + entry.name_size;
+	}
+	return 0;
+}
+static bool fs_dir_remove(byte* mem, uint32 hash, INodePid pid, uint32* ret_removed_size) {
+	//removes the entry of the leaf with hash and pid, returns 0 if it isn't in the leaf
+	DirNodeHeader* header = cast(DirNodeHeader*, mem);
+	uint32 offset = fs_dir_leaf_offset(mem, hash);
+	while(offset < header->mem_size) {
+		DirEntryHeader entry;
+		memcpy(&entry, mem + offset, SIZEOF_HEADER);
+		if(entry.hash != hash) break;
+		uint32 record_size = SIZEOF_HEADER + entry.name_size;
+		if(entry.pid == pid) {
+			memmove(mem + offset, mem + offset + record_size, header->mem_size - offset - record_size);
+			header->mem_size -= record_size;
+			header->records_size -= 1;
+			*ret_removed_size += record_size;
+			return 1;
+		}
+		offset += record_size;
+	}
+	return 0;
+}
+
+static int fs_cmp_pid(const void* a, const void* b) {
+	INodePid pid_a = *cast(const INodePid*, a);
+	INodePid pid_b = *cast(const INodePid*, b);
+	return (pid_a > pid_b) - (pid_a < pid_b);
+}
+static int fs_cmp_key(const void* a, const void* b) {
+	//orders changes by the entry they are about, an entry is only ever known by both its hash and its pid
+	const DirChange* change_a = cast(const DirChange*, a);
+	const DirChange* change_b = cast(const DirChange*, b);
+	if(change_a->hash != change_b->hash) return (change_a->hash > change_b->hash) - (change_a->hash < change_b->hash);
+	return (change_a->pid > change_b->pid) - (change_a->pid < change_b->pid);
+}
+static int fs_get_keys(const DirChange* changes, int changes_size, bool is_all, DirChange** ret_keys) {
+	//sets ret_keys to a copy of the removals among changes, or of every change if is_all, sorted by fs_cmp_key
+	*ret_keys = 0;
+	if(!changes_size) return 0;
+	int keys_size = 0;
+	DirChange* keys = cast(DirChange*, malloc(changes_size*sizeof(DirChange)));
+	for_each_lt(i, changes_size) {
+		if(is_all || !changes[i].file) {
+			keys[keys_size] = changes[i];
+			keys_size += 1;
+		}
+	}
+	qsort(keys, keys_size, sizeof(DirChange), fs_cmp_key);
+	*ret_keys = keys;
+	return keys_size;
+}
+static int fs_get_removed(const File* dir, DirChange** ret_removed) {
+	//the entries of dir that are still on the device but waiting to be removed, see fs_get_keys
+	if(!dir->changes) {
+		*ret_removed = 0;
+		return 0;
+	}
+	return fs_get_keys(dir->changes->changes, dir->changes->size, 0, ret_removed);
+}
+static bool fs_has_key(const DirChange* keys, int keys_size, const DirEntryHeader* entry) {
+	DirChange key = {entry->hash, entry->pid, 0};
+	return keys_size && bsearch(&key, keys, keys_size, sizeof(DirChange), fs_cmp_key);
+}
+
+typedef struct DirBuilder {
+	byte* mem;
+	uint32 nodes_size;
+	uint32 nodes_capacity;
+	uint32 leaf;//the leaf being filled, 0 before the first
+} DirBuilder;
+static byte* fs_builder_node(DirBuilder* builder, uint32 node) {
+	return builder->mem + cast(uint64, node)*DIR_NODE_SIZE;
+}
+static void fs_builder_reserve(DirBuilder* builder, uint32 nodes_size) {
+	if(nodes_size <= builder->nodes_capacity) return;
+	uint32 capacity = 2*nodes_size;
+	builder->mem = cast(byte*, realloc(builder->mem, cast(uint64, capacity)*DIR_NODE_SIZE));
+	memset(fs_builder_node(builder, builder->nodes_capacity), 0, cast(uint64, capacity - builder->nodes_capacity)*DIR_NODE_SIZE);
+	builder->nodes_capacity = capacity;
+}
+static void fs_builder_add_entry(DirBuilder* builder, const byte* record, uint32 record_size) {
+	//entries must be added in hash order, each leaf is filled to DIR_FILL_SIZE
+	if(!builder->leaf || cast(DirNodeHeader*, fs_builder_node(builder, builder->leaf))->mem_size + record_size > DIR_FILL_SIZE) {
+		fs_builder_reserve(builder, builder->nodes_size + 1);
+		if(builder->leaf) cast(DirNodeHeader*, fs_builder_node(builder, builder->leaf))->next = builder->nodes_size;
+		builder->leaf = builder->nodes_size;
+		builder->nodes_size += 1;
+		cast(DirNodeHeader*, fs_builder_node(builder, builder->leaf))->mem_size = sizeof(DirNodeHeader);
+	}
+	byte* leaf = fs_builder_node(builder, builder->leaf);
+	fs_dir_node_insert(leaf, cast(DirNodeHeader*, leaf)->mem_size, record, record_size);
+}
+static uint64 fs_builder_finish(DirBuilder* builder) {
+	//adds levels of branch nodes over the leaves until there is just the root at node 0, returns the size of the tree
+	uint32 first_node = 1;
+	if(builder->nodes_size == 1) return 0;
+	if(builder->nodes_size == 2) {
+		//a single leaf is the root
+		memcpy(fs_builder_node(builder, 0), fs_builder_node(builder, 1), DIR_NODE_SIZE);
+		return DIR_NODE_SIZE;
+	}
+	uint16 level = 0;
+	uint32 branches_max = (DIR_FILL_SIZE - sizeof(DirNodeHeader))/sizeof(DirBranch);
+	while(1) {
+		level += 1;
+		uint32 children_size = builder->nodes_size - first_node;
+		uint32 level_size = (children_size + branches_max - 1)/branches_max;
+		uint32 level_node = (level_size == 1) ? 0 : builder->nodes_size;
+		fs_builder_reserve(builder, builder->nodes_size + level_size);
+		for_each_lt(i, children_size) {
+			uint32 child = first_node + i;
+			byte* mem = fs_builder_node(builder, level_node + i/branches_max);
+			DirNodeHeader* header = cast(DirNodeHeader*, mem);
+			if(i%branches_max == 0) {
+				header->level = level;
+				header->mem_size = sizeof(DirNodeHeader);
+			}
+			DirBranch branch = {fs_dir_record_hash(fs_builder_node(builder, child), sizeof(DirNodeHeader)), child};
+			fs_dir_node_insert(mem, header->mem_size, cast(byte*, &branch), sizeof(DirBranch));
+		}
+		if(level_size == 1) break;
+		first_node = builder->nodes_size;
+		builder->nodes_size += level_size;
+	}
+	return cast(uint64, builder->nodes_size)*DIR_NODE_SIZE;
+}
+static bool fs_dir_rebuild(FS* fs, File* dir, const DirChange* changes, int changes_size) {
+	//builds a new tree of the directory's entries merged with changes, which are sorted by hash, in one buffer
+	//the old tree is read with one inode_read and the new one written with one inode_write, with DIR_FILL_SIZE of each node in use
+	uint64 old_size = dir->inode.mem_size;
+	byte* old_mem = 0;
+	if(old_size) {
+		old_mem = cast(byte*, malloc(old_size));
+		if(!inode_read(&fs->device, &dir->inode, 0, old_mem, old_size)) {
+			free(old_mem);
+			return 0;
+		}
+	}
+	//an entry in the old tree that has a change is dropped, an add is written again from the change
+	//so a save retried after one that failed part of the way doesn't add an entry twice
+	DirChange* keys;
+	int keys_size = fs_get_keys(changes, changes_size, 1, &keys);
+	//node 0 is kept for the root
+	DirBuilder builder = {0, 1, 0, 0};
+	fs_builder_reserve(&builder, 16);
+	const byte* leaf = 0;
+	uint32 offset = sizeof(DirNodeHeader);
+	if(old_mem) {
+		leaf = old_mem;
+		while(cast(const DirNodeHeader*, leaf)->level) {
+			leaf = old_mem + cast(uint64, ptr_add(const DirBranch, leaf, sizeof(DirNodeHeader))->node)*DIR_NODE_SIZE;
+		}
+	}
+	int change_i = 0;
+	while(1) {
+		//move past the end of old leaves, and past the changes that aren't adds
+		while(leaf && offset >= cast(const DirNodeHeader*, leaf)->mem_size) {
+			uint32 next = cast(const DirNodeHeader*, leaf)->next;
+			leaf = next ? old_mem + cast(uint64, next)*DIR_NODE_SIZE : 0;
+			offset = sizeof(DirNodeHeader);
+		}
+		while(change_i < changes_size && !changes[change_i].file) {
+			change_i += 1;
+		}
+		bool has_change = change_i < changes_size;
+		if(!leaf && !has_change) break;
+		if(leaf && (!has_change || fs_dir_record_hash(leaf, offset) <= changes[change_i].hash)) {
+			DirEntryHeader entry;
+			memcpy(&entry, leaf + offset, SIZEOF_HEADER);
+			uint32 record_size = SIZEOF_HEADER + entry.name_size;
+			if(!fs_has_key(keys, keys_size, &entry)) {
+				fs_builder_add_entry(&builder, leaf + offset, record_size);
+			}
+			offset += record_size;
+		} else {
+			File* child = changes[change_i].file;
+			byte record[SIZEOF_HEADER + FS_NAME_MAX];
+			DirEntryHeader entry = {child->inode.pid, child->name_hash, child->name_size, child->inode.status};
+			memcpy(record, &entry, SIZEOF_HEADER);
+			fs_get_filename(child, cast(char*, record + SIZEOF_HEADER));
+			fs_builder_add_entry(&builder, record, SIZEOF_HEADER + child->name_size);
+			change_i += 1;
+		}
+	}
+	free(old_mem);
+	free(keys);
+	uint64 new_size = fs_builder_finish(&builder);
+	//only the part past the old end needs new blocks, so it is written first, and a write that fails for want of space
+	//leaves the old tree as it was, the rest is written over blocks the directory already has
+	uint64 kept_size = old_size < new_size ? old_size : new_size;
+	bool ok = (new_size == kept_size || inode_write(&fs->device, &dir->inode, kept_size, builder.mem + kept_size, new_size - kept_size));
+	ok = ok && (!kept_size || inode_write(&fs->device, &dir->inode, 0, builder.mem, kept_size)) && inode_set_size(&fs->device, &dir->inode, new_size);
+	free(builder.mem);
+	return ok;
+}
+
+static bool fs_dir_apply_(FS* fs, File* dir, const DirChange* changes, int changes_size, DirPath* path) {
+	//changes are made in hash order, so consecutive changes to one leaf are made to it in memory, and it is written once
+	bool is_loaded = 0;
+	bool is_dirty = 0;
+	uint32 removed_size = 0;
+	for_each_lt(i, changes_size) {
+		const DirChange* change = &changes[i];
+		if(is_loaded && (cast(int64, change->hash) <= path->low || change->hash > path->bound)) {
+			if(is_dirty && !fs_dir_write_node(fs, dir, path->nodes[path->depth], path->mem[path->depth])) return 0;
+			is_loaded = 0;
+			is_dirty = 0;
+		}
+		if(!is_loaded) {
+			if(!dir->inode.mem_size) {
+				//the first entry goes in an empty root leaf
+				memset(path->mem[0], 0, DIR_NODE_SIZE);
+				cast(DirNodeHeader*, path->mem[0])->mem_size = sizeof(DirNodeHeader);
+				if(!fs_dir_write_node(fs, dir, 0, path->mem[0])) return 0;
+			}
+			if(!fs_dir_descend(fs, dir, change->hash, path)) return 0;
+			is_loaded = 1;
+		}
+		byte* mem = path->mem[path->depth];
+		if(change->file) {
+			File* child = change->file;
+			path->offsets[path->depth] = fs_dir_leaf_offset(mem, change->hash);
+			//a save that failed part of the way may have added it already
+			if(fs_dir_has_entry(mem, path->offsets[path->depth], change->hash, child->inode.pid)) continue;
+			byte record[SIZEOF_HEADER + FS_NAME_MAX];
+			DirEntryHeader entry = {child->inode.pid, child->name_hash, child->name_size, child->inode.status};
+			memcpy(record, &entry, SIZEOF_HEADER);
+			fs_get_filename(child, cast(char*, record + SIZEOF_HEADER));
+			uint32 record_size = SIZEOF_HEADER + child->name_size;
+			if(cast(DirNodeHeader*, mem)->mem_size + record_size <= DIR_NODE_SIZE) {
+				fs_dir_node_insert(mem, path->offsets[path->depth], record, record_size);
+				is_dirty = 1;
+			} else {
+				//the path is out of date once nodes are split
+				if(!fs_dir_split(fs, dir, path, record, record_size)) return 0;
+				is_loaded = 0;
+				is_dirty = 0;
+			}
+		} else if(fs_dir_remove(mem, change->hash, change->pid, &removed_size)) {
+			is_dirty = 1;
+		} else if(path->bound == change->hash) {
+			//the entry may be further along a run of equal hashes, in the leaves after this one
+			if(is_dirty && !fs_dir_write_node(fs, dir, path->nodes[path->depth], mem)) return 0;
+			is_loaded = 0;
+			is_dirty = 0;
+			while(cast(DirNodeHeader*, mem)->next) {
+				uint32 next = cast(DirNodeHeader*, mem)->next;
+				if(!fs_dir_read_node(fs, dir, next, mem)) return 0;
+				if(fs_dir_remove(mem, change->hash, change->pid, &removed_size)) {
+					if(!fs_dir_write_node(fs, dir, next, mem)) return 0;
+					break;
 				}
-				if(!inode_read(&fs->device, &dir->inode, cur_offset, &cur_filename->text, cur_text_left)) return 0;
-				cur_offset += cur_text_left;
-				cur_filename->next = 0;
+				DirNodeHeader* header = cast(DirNodeHeader*, mem);
+				if(header->mem_size > sizeof(DirNodeHeader) && fs_dir_record_hash(mem, sizeof(DirNodeHeader)) != change->hash) break;
 			}
-			new_file->next = dir->head_child;
-			dir->head_child = new_file;
 		}
+		//an entry that isn't found was removed by a save that failed part of the way
+	}
+	if(is_dirty && !fs_dir_write_node(fs, dir, path->nodes[path->depth], path->mem[path->depth])) return 0;
+	if(removed_size) {
+		//the tree is rebuilt once more than half of the directory's file is taken by removed entries
+		byte* mem = path->mem[0];
+		DirNodeHeader* header = cast(DirNodeHeader*, mem);
+		if(!fs_dir_read_node(fs, dir, 0, mem)) return 0;
+		header->removed_size += removed_size;
+		if(2*cast(uint64, header->removed_size) > dir->inode.mem_size) return fs_dir_rebuild(fs, dir, 0, 0);
+		return fs_dir_write_node(fs, dir, 0, mem);
+	}
+	return 1;
+}
+static void* fs_destroyer_main(void* arg) {
+	FS* fs = cast(FS*, arg);
+	pthread_mutex_lock(&fs->unlinked_lock);
+	while(1) {
+		while(!fs->unlinked_size && !fs->is_stopping) {
+			pthread_cond_wait(&fs->unlinked_cond, &fs->unlinked_lock);
+		}
+		if(!fs->unlinked_size) break;
+		//every inode waiting is taken at once, so removals only wait on the lock for as long as this takes
+		INode* inodes = fs->unlinked;
+		int inodes_size = fs->unlinked_size;
+		fs->unlinked = 0;
+		fs->unlinked_size = 0;
+		fs->unlinked_capacity = 0;
+		fs->is_destroying = 1;
+		pthread_mutex_unlock(&fs->unlinked_lock);
+		bool ok = 1;
+		for_each_lt(i, inodes_size) {
+			ok = inode_destroy(&fs->device, &fs->inode_a, &inodes[i]) && ok;
+		}
+		free(inodes);
+		pthread_mutex_lock(&fs->unlinked_lock);
+		if(!ok) fs->is_destroy_failed = 1;
+		fs->is_destroying = 0;
+		pthread_cond_broadcast(&fs->unlinked_cond);
+	}
+	pthread_mutex_unlock(&fs->unlinked_lock);
+	return 0;
+}
+static void fs_queue_unlinked(FS* fs, Unlinked* unlinked) {
+	//the inodes' blocks are only ever reached through them, so the destroyer frees them without holding any lock of ours
+	pthread_mutex_lock(&fs->unlinked_lock);
+	if(!fs->has_destroyer) {
+		fs->has_destroyer = pthread_create(&fs->destroyer, 0, fs_destroyer_main, fs) == 0;
+	}
+	while(unlinked) {
+		Unlinked* next = unlinked->next;
+		if(!fs->has_destroyer) {
+			//without a thread of its own it is destroyed right away
+			if(!inode_destroy(&fs->device, &fs->inode_a, &unlinked->inode)) fs->is_destroy_failed = 1;
+		} else {
+			if(fs->unlinked_size >= fs->unlinked_capacity) {
+				fs->unlinked_capacity = fs->unlinked_capacity ? 2*fs->unlinked_capacity : 16;
+				fs->unlinked = cast(INode*, realloc(fs->unlinked, fs->unlinked_capacity*sizeof(INode)));
+			}
+			fs->unlinked[fs->unlinked_size] = unlinked->inode;
+			fs->unlinked_size += 1;
+		}
+		free(unlinked);
+		unlinked = next;
+	}
+	pthread_cond_broadcast(&fs->unlinked_cond);
+	pthread_mutex_unlock(&fs->unlinked_lock);
+}
+static bool fs_wait_unlinked(FS* fs) {
+	//the inode table and the free blocks can't be saved while the destroyer is changing them
+	//returns 0 if any inode failed to be destroyed since this was last called
+	pthread_mutex_lock(&fs->unlinked_lock);
+	while(fs->unlinked_size || fs->is_destroying) {
+		pthread_cond_wait(&fs->unlinked_cond, &fs->unlinked_lock);
+	}
+	bool ok = !fs->is_destroy_failed;
+	fs->is_destroy_failed = 0;
+	pthread_mutex_unlock(&fs->unlinked_lock);
+	return ok;
+}
+static int fs_cmp_change(const void* a, const void* b) {
+	//removals of moved entries go last, see fs_save_changes
+	//otherwise removals go before adds of the same hash, since the pid removed may have been given to the file added
+	const DirChange* change_a = cast(const DirChange*, a);
+	const DirChange* change_b = cast(const DirChange*, b);
+	if(change_a->is_moved != change_b->is_moved) return change_a->is_moved - change_b->is_moved;
+	if(change_a->hash != change_b->hash) return (change_a->hash > change_b->hash) - (change_a->hash < change_b->hash);
+	return (change_a->file != 0) - (change_b->file != 0);
+}
+static bool fs_save_changes(FS* fs, File* dir, bool is_moved) {
+	//writes either the removals of moved entries, or every other change, the rest are kept for later
+	//only the entries added or removed since the last save are written, so saving costs as much as what changed
+	DirChanges* changes = dir->changes;
+	if(!changes) return 1;
+	if(!is_moved) {
+		//a moved entry can be given back to the file, or its pid to a new one, and is then added again by a change
+		//saved before the removal would, so the removal is saved first, along with the add
+		qsort(changes->changes, changes->size, sizeof(DirChange), fs_cmp_key);
+		for(int i = 0; i < changes->size;) {
+			int j = i;
+			bool has_add = 0;
+			while(j < changes->size && !fs_cmp_key(&changes->changes[i], &changes->changes[j])) {
+				has_add |= changes->changes[j].file != 0;
+				j += 1;
+			}
+			if(has_add) {
+				for(int k = i; k < j; k += 1) changes->changes[k].is_moved = 0;
+			}
+			i = j;
+		}
+	}
+	qsort(changes->changes, changes->size, sizeof(DirChange), fs_cmp_change);
+	//readers of the directory walking the list or a leaf start over, see DirReader
+	dir->saves += 1;
+	int moved_i = 0;
+	while(moved_i < changes->size && !changes->changes[moved_i].is_moved) {
+		moved_i += 1;
+	}
+	int begin = is_moved ? moved_i : 0;
+	int end = is_moved ? changes->size : moved_i;
+	DirChange* saved = &changes->changes[begin];
+	int saved_size = end - begin;
+	if(saved_size) {
+		bool ok;
+		if(2*cast(uint64, saved_size) >= dir->inode.mem_size/DIR_NODE_SIZE) {
+			//with this many changes most leaves would be written anyway, so the whole tree is rewritten at once
+			ok = fs_dir_rebuild(fs, dir, saved, saved_size);
+		} else {
+			DirPath* path = cast(DirPath*, malloc(sizeof(DirPath)));
+			ok = fs_dir_apply_(fs, dir, saved, saved_size, path);
+			free(path);
+		}
+		if(!ok) {
+			//the changes are kept for the next save, making any of them again changes nothing
+			dir->flags |= DIR_IS_SAVE_FAILED;
+			return 0;
+		}
+		for_each_lt(i, saved_size) {
+			if(saved[i].file) saved[i].file->flags &= ~FILE_IS_NEW;
+			//no entry leads to them anymore, so their pids and blocks can be given to other files
+			if(saved[i].unlinked) fs_queue_unlinked(fs, saved[i].unlinked);
+		}
+		memmove(saved, &changes->changes[end], (changes->size - end)*sizeof(DirChange));
+		changes->size -= saved_size;
+	}
+	if(!changes->size) {
+		free(changes);
+		dir->changes = 0;
+		dir->flags &= ~DIR_IS_SAVE_FAILED;
+	}
+	return 1;
+}
+static bool fs_save_dir(FS* fs, File* dir) {
+	ASSERT(dir->inode.status == INODE_DIR);
+	if(!fs_save_changes(fs, dir, 0) || !fs_save_changes(fs, dir, 1)) return 0;
+	if(!inode_save(&fs->device, &fs->inode_a, &dir->inode)) return 0;
+	dir->flags &= ~FILE_IS_DIRTY;
+	return 1;
+}
+
+static int fs_cmp_file_pid(const void* a, const void* b) {
+	INodePid pid_a = (*cast(File* const*, a))->inode.pid;
+	INodePid pid_b = (*cast(File* const*, b))->inode.pid;
+	return (pid_a > pid_b) - (pid_a < pid_b);
+}
+static bool fs_save_file(FS* fs, File* file) {
+	if(file->flags & FILE_IS_REMOVED) {
+		//its inode goes to the destroyer once its removal is saved, only its memory is left
+		if(file->name_size > FILE_NAME_INLINE) fs_retire(fs, file->name_long, 1);
+		fs_retire(fs, file, 1);
+		return 1;
+	}
+	if(fs_is_dir(file)) return fs_save_dir(fs, file);
+	if(!fs_flush_delayed(fs, file) || !fs_flush_tail(fs, file)) return 0;
+	if(!inode_save(&fs->device, &fs->inode_a, &file->inode)) return 0;
+	file->flags &= ~FILE_IS_DIRTY;
+	return 1;
+}
+static bool fs_save_dirty_(FS* fs) {
+	//only the files on fs->dirty are saved, so a save costs as much as what changed since the last one, not the whole cache
+	//they are saved in pid order, so the inodes sharing a block of the inode table are written one after the other
+	int files_size = fs->dirty_size;
+	if(!files_size) return 1;
+	File** files = cast(File**, malloc(files_size*sizeof(File*)));
+	File* file = fs->dirty;
+	for_each_lt(i, files_size) {
+		files[i] = file;
+		file = file->dirty_next;
+	}
+	fs->dirty = 0;
+	fs->dirty_size = 0;
+	qsort(files, files_size, sizeof(File*), fs_cmp_file_pid);
+	//every directory's adds are written before any moved entry is removed, so a file moved to another directory
+	//is never left without an entry on the device by a save that fails part of the way, see fs_rename
+	bool ok = 1;
+	for(int i = 0; ok && i < files_size; i += 1) {
+		if(fs_is_dir(files[i]) && !(files[i]->flags & FILE_IS_REMOVED)) ok = fs_save_changes(fs, files[i], 0);
+	}
+	int saved_size = 0;
+	while(ok && saved_size < files_size) {
+		ok = fs_save_file(fs, files[saved_size]);
+		if(ok) saved_size += 1;
+	}
+	//the ones left are saved by the next save
+	for(int i = saved_size; i < files_size; i += 1) {
+		files[i]->flags &= ~FILE_IS_DIRTY;
+		fs_set_dirty(fs, files[i]);
+	}
+	free(files);
+	return ok;
+}
+
+static bool fs_load_inode(FS* fs, File* file) {
+	//every public function that uses a file's inode calls this first, so restoring a directory reads no inodes
+	if(!(file->flags & FILE_NO_INODE)) return 1;
+	INode inode;
+	if(!inode_restore(&fs->device, &fs->inode_a, file->inode.pid, &inode)) return 0;
+	//the pid and status are left alone, they are read without the file's lock
+	file->inode.level = inode.level;
+	file->inode.flags = inode.flags;
+	file->inode.mem_size = inode.mem_size;
+	memcpy(file->inode.blocks, inode.blocks, sizeof(inode.blocks));
+	file->flags &= ~FILE_NO_INODE;
+	return 1;
+}
+static bool fs_lock_loaded(FS* fs, File* file, bool is_write) {
+	//takes the file's lock and makes sure its inode is loaded, returns 0 without the lock if it couldn't be
+	if(!is_write) {
+		fs_lock_read(fs, file);
+		if(!(file->flags & FILE_NO_INODE)) return 1;
+		//loading the inode changes the file, and once it is loaded it stays that way while the file is pinned
+		fs_unlock(fs, file);
+		if(!fs_lock_loaded(fs, file, 1)) return 0;
+		fs_unlock(fs, file);
+		fs_lock_read(fs, file);
+		return 1;
+	}
+	fs_lock_write(fs, file);
+	if(fs_load_inode(fs, file)) return 1;
+	fs_unlock(fs, file);
+	return 0;
+}
+static File* fs_cache_entry(FS* fs, File* dir, const byte* record) {
+	DirEntryHeader entry;
+	memcpy(&entry, record, SIZEOF_HEADER);
+	File* new_file = cast(File*, fs_cache_alloc(fs, dir));
+	if(!new_file) return 0;
+	new_file->head_child = 0;
+	new_file->delayed = 0;
+	new_file->tail = 0;
+	new_file->index = 0;
+	new_file->changes = 0;
+	new_file->lru_prev = 0;
+	new_file->lru_next = 0;
+	new_file->lru_epoch = 0;
+	new_file->pins = 0;
+	new_file->name_size = 0;
+	//the inode is only read once the file is used, see fs_load_inode
+	new_file->flags = FILE_NO_INODE;
+	new_file->inode.pid = entry.pid;
+	new_file->inode.status = entry.status;
+	if(!fs_set_filename_(fs, new_file, cast(const char*, record + SIZEOF_HEADER), entry.name_size, dir)) {
+		fs_free_file(fs, new_file);
+		return 0;
+	}
+	new_file->next = dir->head_child;
+	dir->head_child = new_file;
+	fs_index_insert(fs, &dir->index, new_file);
+	return new_file;
+}
+static bool fs_is_removed(DirChanges* changes, const DirEntryHeader* entry) {
+	//whether the entry is waiting to be removed, it is still in the directory's file until the next save
+	if(!changes) return 0;
+	for_each_lt(i, changes->size) {
+		DirChange* change = &changes->changes[i];
+		if(!change->file && change->hash == entry->hash && change->pid == entry->pid) return 1;
+	}
+	return 0;
+}
+static bool fs_restore_dir_(FS* fs, File* dir, const byte* dir_mem, const DirChange* removed, int removed_size) {
+	//walks down the leftmost path, then along the leaves; children already cached by a lookup are skipped
+	//NOTE: this function will fail horribly if the dir is corrupted, maybe fix?
+	const byte* mem = dir_mem;
+	while(cast(const DirNodeHeader*, mem)->level) {
+		mem = dir_mem + cast(uint64, ptr_add(const DirBranch, mem, sizeof(DirNodeHeader))->node)*DIR_NODE_SIZE;
+	}
+	while(1) {
+		const DirNodeHeader* header = cast(const DirNodeHeader*, mem);
+		uint32 offset = sizeof(DirNodeHeader);
+		while(offset < header->mem_size) {
+			DirEntryHeader entry;
+			memcpy(&entry, mem + offset, SIZEOF_HEADER);
+			bool is_skipped = fs_index_find(dir->index, cast(const char*, mem + offset + SIZEOF_HEADER), entry.name_size, entry.hash) != 0;
+			if(!is_skipped) is_skipped = fs_has_key(removed, removed_size, &entry);
+			if(!is_skipped && !fs_cache_entry(fs, dir, mem + offset)) return 0;
+			offset += SIZEOF_HEADER + entry.name_size;
+		}
+		if(!header->next) return 1;
+		mem = dir_mem + cast(uint64, header->next)*DIR_NODE_SIZE;
+	}
+}
+static bool fs_restore_dir(FS* fs, File* dir) {
+	ASSERT(dir->inode.status == INODE_DIR);
+	if(dir->flags & DIR_IS_CACHED) return 1;
+	if(dir->inode.mem_size) {
+		//the whole directory is read at once, rather than a node at a time along the leaves
+		byte* mem = cast(byte*, malloc(dir->inode.mem_size));
+		if(!inode_read(&fs->device, &dir->inode, 0, mem, dir->inode.mem_size)) {
+			free(mem);
+			return 0;
+		}
+		DirChange* removed;
+		int removed_size = fs_get_removed(dir, &removed);
+		fs_touch_dir(fs, dir);
+		fs_pin(dir);
+		dir->flags |= DIR_IS_RESTORING;
+		bool ok = fs_restore_dir_(fs, dir, mem, removed, removed_size);
+		dir->flags &= ~DIR_IS_RESTORING;
+		fs_unpin(dir);
+		free(mem);
+		free(removed);
+		if(!ok) return 0;
 	}
 	dir->flags |= DIR_IS_CACHED;
 	return 1;
 }
 
 
+static void fs_start_io(FS* fs) {
+	//a failure to start the I/O threads is not fatal, large I/O just stays on the calling thread
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	//one core is left to the calling thread
+	int threads_size = (cpus - 1 > FS_IO_THREADS_MAX) ? FS_IO_THREADS_MAX : cpus - 1;
+	device_start_io(&fs->device, threads_size, FS_IO_SPLIT_SIZE);
+}
+
+static void fs_init_memory(FS* fs) {
+	//sets up everything kept in memory only, the same way for a new file system and a mounted one
+	fs->dir_cache = mam_pool_init(File, malloc(DIR_CACHE_SIZE), DIR_CACHE_SIZE);
+	fs->lru_head = 0;
+	fs->lru_tail = 0;
+	fs->dirty = 0;
+	fs->dirty_size = 0;
+	fs->cache_hits = 0;
+	fs->cache_misses = 0;
+	fs->cache_evictions = 0;
+	fs->cache_files_evicted = 0;
+	fs->cache_negative_hits = 0;
+	fs->negatives = cast(DirNegative*, calloc(DIR_NEGATIVES_SIZE, sizeof(DirNegative)));
+	fs->view_bytes = 0;
+	fs->is_delayed_alloc = 0;
+	fs->delayed_blocks_size = 0;
+	fs->is_concurrent = 0;
+	fs->locks = 0;
+	pthread_mutex_init(&fs->cache_lock, 0);
+	fs->lru_epoch = 1;
+	fs->lookup_epoch = 0;
+	fs->lookups = 0;
+	pthread_mutex_init(&fs->retired_lock, 0);
+	fs->retired = 0;
+	fs->retired_size = 0;
+	fs->retired_capacity = 0;
+	fs->handle_chunks = 0;
+	fs->handles_size = 0;
+	fs->handles_free = -1;
+	pthread_mutex_init(&fs->handles_lock, 0);
+	pthread_mutex_init(&fs->moves_lock, 0);
+	fs->unlinked = 0;
+	fs->unlinked_size = 0;
+	fs->unlinked_capacity = 0;
+	fs->is_destroying = 0;
+	fs->is_destroy_failed = 0;
+	fs->has_destroyer = 0;
+	fs->is_stopping = 0;
+	pthread_mutex_init(&fs->unlinked_lock, 0);
+	pthread_cond_init(&fs->unlinked_cond, 0);
+}
+
 bool fs_init(FS* fs, const char* device_name, uint64 device_capacity) {
 	//NOTE: device_capacity may be rounded down
 	if(!device_create(&fs->device, device_name, FS_BLOCK_SIZE, device_capacity/FS_BLOCK_SIZE)) return 0;
+	fs_start_io(fs);
 	inode_initfs(&fs->inode_a, FS_BLOCK_SIZE);
-	//TODO: manage the pool as a cache
-	fs->dir_cache = mam_pool_init(File, malloc(DIR_CACHE_SIZE), DIR_CACHE_SIZE);
-	if(!fs_init_file(fs, &fs->root, "/", 1, INODE_DIR)) return 0;
+	fs_init_memory(fs);
+	if(!fs_init_file(fs, &fs->root, "/", 1, INODE_DIR, 0)) return 0;
 	return 1;
 }
 bool fs_mount(FS* fs, const char* device_name) {
 	if(!device_open(&fs->device, device_name) || !inode_mountfs(&fs->device, &fs->inode_a)) return 0;
-	//TODO: manage the pool as a cache
-	fs->dir_cache = mam_pool_init(File, malloc(DIR_CACHE_SIZE), DIR_CACHE_SIZE);
+	fs_start_io(fs);
+	fs_init_memory(fs);
 	INodePid root_pid;
-	block_reads_m(&fs->device, 0, sizeof(fs->device.persistent_data) + sizeof(INodeAllocator), &root_pid, sizeof(INodePid));
+	block_reads_m(&fs->device, 0, sizeof(fs->device.persistent_data) + sizeof(fs->inode_a.persistent_data), &root_pid, sizeof(INodePid));
 	{// restore root
 		if(!root_pid) return 0;
-		if(!inode_restore(&fs->device, root_pid, &fs->root.inode)) return 0;
+		if(!inode_restore(&fs->device, &fs->inode_a, root_pid, &fs->root.inode)) return 0;
 		fs->root.head_child = 0;
+		fs->root.delayed = 0;
+		fs->root.tail = 0;
+		fs->root.index = 0;
+		fs->root.changes = 0;
+		fs->root.lru_prev = 0;
+		fs->root.lru_next = 0;
+		fs->root.lru_epoch = 0;
+		fs->root.pins = 0;
 		fs->root.flags = 0;
 		fs->root.next = 0;
 		fs->root.inode.status = INODE_DIR;
-		fs->root.name = 0;
-		fs_set_filename(fs, &fs->root, "/", 1);
-		if(!fs_restore_dir(fs, &fs->root)) return 0;
+		fs->root.name_size = 0;
+		fs_set_filename_(fs, &fs->root, "/", 1, 0);
 	}
 	return 1;
 }
 bool fs_unmount(FS* fs) {
+	//the directories are saved first, which hands the inodes of the files removed since the last save to the destroyer
 	//write the root inode to the master block
-	block_writes_m(&fs->device, 0, sizeof(fs->device.persistent_data) + sizeof(INodeAllocator), &fs->root.inode.pid, sizeof(INodePid));
-	return fs_save_all_(fs, &fs->root) && inode_unmountfs(&fs->device, &fs->inode_a) && device_close(&fs->device);
+	block_writes_m(&fs->device, 0, sizeof(fs->device.persistent_data) + sizeof(fs->inode_a.persistent_data), &fs->root.inode.pid, sizeof(INodePid));
+	bool is_saved = fs_save_dirty_(fs);
+	if(fs->has_destroyer) {
+		//the destroyer destroys every inode still waiting before it stops
+		pthread_mutex_lock(&fs->unlinked_lock);
+		fs->is_stopping = 1;
+		pthread_cond_broadcast(&fs->unlinked_cond);
+		pthread_mutex_unlock(&fs->unlinked_lock);
+		pthread_join(fs->destroyer, 0);
+	}
+	bool is_destroyed = !fs->is_destroy_failed;
+	bool ret = is_saved && inode_unmountfs(&fs->device, &fs->inode_a) && device_close(&fs->device) && is_destroyed;
+	fs_free_index_(&fs->root);
 	free(fs->dir_cache);
+	free(fs->negatives);
+	fs_set_concurrent(fs, 0);
+	pthread_mutex_destroy(&fs->cache_lock);
+	pthread_mutex_destroy(&fs->retired_lock);
+	if(fs->handle_chunks) {
+		for_each_lt(i, fs->handles_size) {
+			FileHandle* handle = &fs->handle_chunks[i/FS_HANDLE_CHUNK_SIZE][i%FS_HANDLE_CHUNK_SIZE];
+			if(handle->file) free(handle->map);
+		}
+		for_each_lt(i, FS_HANDLE_CHUNKS_MAX) {
+			free(fs->handle_chunks[i]);
+		}
+		free(fs->handle_chunks);
+	}
+	pthread_mutex_destroy(&fs->handles_lock);
+	pthread_mutex_destroy(&fs->moves_lock);
+	free(fs->unlinked);
+	pthread_mutex_destroy(&fs->unlinked_lock);
+	pthread_cond_destroy(&fs->unlinked_cond);
+	return ret;
 }
 bool fs_save(FS* fs) {
+	//returns 0 if destroying the inode of a removed file failed since the last save, see fs_unlink
+	//the directories are saved before the inodes of the files removed from them are destroyed, see fs_drop_child
 	//write the root inode to the master block
-	block_writes_m(&fs->device, 0, sizeof(fs->device.persistent_data) + sizeof(INodeAllocator), &fs->root.inode.pid, sizeof(INodePid));
-	return fs_save_all_(fs, &fs->root) && inode_unmountfs(&fs->device, &fs->inode_a) && device_save(&fs->device);
+	block_writes_m(&fs->device, 0, sizeof(fs->device.persistent_data) + sizeof(fs->inode_a.persistent_data), &fs->root.inode.pid, sizeof(INodePid));
+	bool is_saved = fs_save_dirty_(fs);
+	bool is_destroyed = fs_wait_unlinked(fs);
+	return is_saved && inode_savefs(&fs->device, &fs->inode_a) && device_save(&fs->device) && is_destroyed;
+}
+
+bool fs_set_concurrent(FS* fs, bool is_enabled) {
+	if(fs->is_concurrent == is_enabled) return 1;
+	if(is_enabled) {
+		if(!fs_set_delayed_alloc(fs, 0)) return 0;
+		//the locks are striped across files so that a File stays the same size
+		fs->locks = cast(pthread_rwlock_t*, malloc(FS_LOCKS_SIZE*sizeof(pthread_rwlock_t)));
+		for_each_lt(i, FS_LOCKS_SIZE) {
+			pthread_rwlock_init(&fs->locks[i], 0);
+		}
+		fs->lookups = cast(LookupCount*, aligned_alloc(sizeof(LookupCount), 2*FS_LOOKUP_STRIPES*sizeof(LookupCount)));
+		memzero(fs->lookups, 2*FS_LOOKUP_STRIPES*sizeof(LookupCount));
+	} else {
+		//no lookup is running, so what they could have been reading is freed right away
+		fs_reclaim(fs, 0);
+		for_each_lt(i, FS_LOCKS_SIZE) {
+			pthread_rwlock_destroy(&fs->locks[i]);
+		}
+		free(fs->locks);
+		fs->locks = 0;
+		free(fs->lookups);
+		fs->lookups = 0;
+	}
+	fs->is_concurrent = is_enabled;
+	return 1;
 }
 
 File* fs_get_root(FS* fs) {
@@ -263,33 +2144,147 @@ File* fs_get_root(FS* fs) {
 }
 
 int fs_cmp_filename(File* file, const char* name, uint16 name_size) {
-	Filename* filename = file->name;
-	uint cur_left = file->name_size;
-	while(cur_left > FILENAME_TEXT_SIZE) {
-		int c = memcmp(name, &filename->text, FILENAME_TEXT_SIZE);
-		if(c != 0) return c;
-		cur_left -= FILENAME_TEXT_SIZE;
-		name += FILENAME_TEXT_SIZE;
-		filename = filename->next;
-	}
-	return memcmp(name, &filename->text, cur_left);
+	uint size = (name_size < file->name_size) ? name_size : file->name_size;
+	int c = memcmp(name, fs_filename_text(file), size);
+	if(c != 0) return c;
+	//a name that is a prefix of the other comes first
+	return cast(int, name_size) - cast(int, file->name_size);
 }
 
 
+static bool fs_get_any_(FS* fs, File* dir, const char* name, uint16 name_size, uint32 name_hash, File** ret_file) {
+	//NOTE: failure only occurs when reading the directory
+	//dir's inode has to be loaded, and in concurrent mode its write lock held
+	fs_touch_dir(fs, dir);
+	*ret_file = fs_index_find(dir->index, name, name_size, name_hash);
+	if(*ret_file || (dir->flags & DIR_IS_CACHED) || name_size > FS_NAME_MAX) {
+		if(!fs->is_concurrent) fs->cache_hits += 1;
+		return 1;
+	}
+	fs_lock_cache(fs);
+	bool is_negative = fs_negative_find(fs, dir->inode.pid, name, name_size, name_hash) != 0;
+	fs_unlock_cache(fs);
+	if(is_negative) {
+		fs_count(&fs->cache_negative_hits);
+		return 1;
+	}
+	fs_count(&fs->cache_misses);
+	//only the nodes on the path to the name are read, the rest of the directory stays uncached
+	DirPath* path = cast(DirPath*, malloc(sizeof(DirPath)));
+	const byte* entry;
+	bool ok = fs_dir_find(fs, dir, name, name_size, name_hash, path, &entry);
+	if(ok && entry) {
+		DirEntryHeader header;
+		memcpy(&header, entry, SIZEOF_HEADER);
+		if(fs_is_removed(dir->changes, &header)) entry = 0;
+	}
+	if(ok && entry) {
+		fs_pin(dir);
+		*ret_file = fs_cache_entry(fs, dir, entry);
+		fs_unpin(dir);
+		ok = *ret_file != 0;
+	} else if(ok) {
+		fs_lock_cache(fs);
+		fs_negative_insert(fs, dir->inode.pid, name, name_size, name_hash);
+		fs_unlock_cache(fs);
+	}
+	free(path);
+	return ok;
+}
 bool fs_get_any(FS* fs, File* dir, const char* name, uint16 name_size, File** ret_file) {
-	//NOTE: will cache dir always, failure only occurs then
 	ASSERT(fs_is_dir(dir));
+	uint32 name_hash = fs_hash_filename(FS_HASH_SEED, name, name_size);
+	if(fs->is_concurrent) {
+		//cached names are found without taking any lock, so those lookups never wait on each other or on writers
+		int lookup = fs_enter_lookup(fs);
+		File* file = fs_index_find(__atomic_load_n(&dir->index, __ATOMIC_ACQUIRE), name, name_size, name_hash);
+		bool is_pinned = file && fs_try_pin(file);
+		fs_exit_lookup(fs, lookup);
+		if(is_pinned) {
+			fs_touch_dir(fs, dir);
+			*ret_file = file;
+			return 1;
+		}
+		//only under the lock is a name missing from the index known to be missing from a fully cached directory
+		fs_lock_read(fs, dir);
+		file = fs_index_find(dir->index, name, name_size, name_hash);
+		if(file || (dir->flags & DIR_IS_CACHED) || name_size > FS_NAME_MAX) {
+			fs_touch_dir(fs, dir);
+			fs_hand_out(fs, file);
+			fs_unlock(fs, dir);
+			*ret_file = file;
+			return 1;
+		}
+		fs_unlock(fs, dir);
+	}
 	*ret_file = 0;
-	if(!fs_restore_dir(fs, dir)) return 0;
-	File* cur_child = dir->head_child;
-	while(cur_child) {
-		//write the name immediately after
-		if(fs_cmp_filename(cur_child, name, name_size) == 0) {
-			*ret_file = cur_child;
+	if(!fs_lock_loaded(fs, dir, 1)) return 0;
+	bool ok = fs_get_any_(fs, dir, name, name_size, name_hash, ret_file);
+	if(ok) fs_hand_out(fs, *ret_file);
+	fs_unlock(fs, dir);
+	return ok;
+}
+static bool fs_open_any(FS* fs, File* dir, const char* name, uint16 name_size, uint16 status, File** ret_file) {
+	//looks the name up and creates it if it is missing, under one lock so no other thread can create it in between
+	ASSERT(fs_is_dir(dir));
+	uint32 name_hash = fs_hash_filename(FS_HASH_SEED, name, name_size);
+	*ret_file = 0;
+	if(!fs_lock_loaded(fs, dir, 1)) return 0;
+	bool ok = fs_get_any_(fs, dir, name, name_size, name_hash, ret_file);
+	if(ok && !*ret_file) {
+		*ret_file = fs_create_file(fs, dir, name, name_size, status);
+		ok = *ret_file != 0;
+	}
+	if(ok) fs_hand_out(fs, *ret_file);
+	fs_unlock(fs, dir);
+	return ok;
+}
+
+bool fs_resolve_path(FS* fs, File* dir, const char* path, uint path_size, uint flags, File** ret_file) {
+	//NOTE: failure only occurs when reading a directory or creating the file
+	File* file = dir;
+	uint i = 0;
+	if(path_size && path[0] == '/') file = fs_get_root(fs);
+	//every file on the way is handed out like the last one, and taken back once its child is found
+	fs_hand_out(fs, file);
+	while(1) {
+		//find the next name
+		while(i < path_size && path[i] == '/') i += 1;
+		if(i >= path_size) break;
+		uint name_offset = i;
+		while(i < path_size && path[i] != '/') i += 1;
+		uint name_size = i - name_offset;
+		const char* name = path + name_offset;
+		if(name_size == 1 && name[0] == '.') continue;
+		*ret_file = 0;
+		if(!fs_is_dir(file)) {
+			fs_take_back(fs, file);
 			return 1;
-		};
-		cur_child = cur_child->next;
+		}
+		File* child = 0;
+		bool ok = 1;
+		if(name_size <= FS_NAME_MAX) ok = fs_get_any(fs, file, name, name_size, &child);
+		if(ok && !child) {
+			bool is_last = 1;
+			for(uint j = i; j < path_size; j += 1) {
+				if(path[j] != '/') is_last = 0;
+			}
+			if(!is_last || !(flags & FS_PATH_CREATE)) {
+				fs_take_back(fs, file);
+				return 1;
+			}
+			//in concurrent mode another thread may create it first, so what is found is checked like any other file
+			ok = fs_open_any(fs, file, name, name_size, (flags & FS_PATH_DIR) ? INODE_DIR : INODE_FILE, &child);
+		}
+		fs_take_back(fs, file);
+		if(!ok) return 0;
+		file = child;
 	}
+	if(((flags & FS_PATH_FILE) && fs_is_dir(file)) || ((flags & FS_PATH_DIR) && !fs_is_dir(file))) {
+		fs_take_back(fs, file);
+		file = 0;
+	}
+	*ret_file = file;
 	return 1;
 }
 
@@ -297,20 +2292,17 @@ bool fs_get_file(FS* fs, File* dir, const char* name, uint16 name_size, File** r
 	if(!fs_get_any(fs, dir, name, name_size, ret_file)) return 0;
 	if(*ret_file && fs_is_dir(*ret_file)) {
 		//the item is a directory so reject
+		fs_take_back(fs, *ret_file);
 		*ret_file = 0;
 	}
 	return 1;
 }
 bool fs_open_file(FS* fs, File* dir, const char* name, uint16 name_size, File** ret_file) {
-	if(!fs_get_any(fs, dir, name, name_size, ret_file)) return 0;
-	if(*ret_file) {
-		if(fs_is_dir(*ret_file)) {
-			//the item is a directory so reject
-			*ret_file = 0;
-		}
-	} else {
-		*ret_file = fs_create_file(fs, dir, name, name_size, INODE_FILE);
-		return *ret_file != 0;
+	if(!fs_open_any(fs, dir, name, name_size, INODE_FILE, ret_file)) return 0;
+	if(fs_is_dir(*ret_file)) {
+		//the item is a directory so reject
+		fs_take_back(fs, *ret_file);
+		*ret_file = 0;
 	}
 	return 1;
 }
@@ -318,33 +2310,264 @@ bool fs_get_dir(FS* fs, File* dir, const char* name, uint16 name_size, File** re
 	if(!fs_get_any(fs, dir, name, name_size, ret_dir)) return 0;
 	if(*ret_dir && !fs_is_dir(*ret_dir)) {
 		//the item is a file so reject
+		fs_take_back(fs, *ret_dir);
 		*ret_dir = 0;
 	}
 	return 1;
 }
 bool fs_open_dir(FS* fs, File* dir, const char* name, uint16 name_size, File** ret_dir) {
-	if(!fs_get_any(fs, dir, name, name_size, ret_dir)) return 0;
-	if(*ret_dir) {
-		if(!fs_is_dir(*ret_dir)) {
-			//the item is a file so reject
-			*ret_dir = 0;
+	if(!fs_open_any(fs, dir, name, name_size, INODE_DIR, ret_dir)) return 0;
+	if(!fs_is_dir(*ret_dir)) {
+		//the item is a file so reject
+		fs_take_back(fs, *ret_dir);
+		*ret_dir = 0;
+	}
+	return 1;
+}
+
+static bool fs_clone_file_(FS* fs, File* dir, const char* name, uint16 name_size, File* file, File** ret_file) {
+	if(!fs_load_inode(fs, dir) || !fs_load_inode(fs, file)) return 0;
+	//file could otherwise be evicted to make room for the new one
+	fs_pin(file);
+	File* cur_file;
+	bool ok = fs_get_any_(fs, dir, name, name_size, fs_hash_filename(FS_HASH_SEED, name, name_size), &cur_file);
+	File* new_file = 0;
+	if(ok && !cur_file) {
+		//everything the file holds in memory has to be on the device to be shared
+		ok = fs_flush_delayed(fs, file) && fs_flush_tail(fs, file);
+		if(ok) new_file = fs_create_file(fs, dir, name, name_size, INODE_FILE);
+	}
+	fs_unpin(file);
+	if(!ok || cur_file) return ok;
+	if(!new_file) return 0;
+	INode* inode = &new_file->inode;
+	inode->level = file->inode.level;
+	inode->flags = file->inode.flags;
+	inode->mem_size = file->inode.mem_size;
+	for_each_lt(i, BLOCKS_PER_INODE) {
+		inode->blocks[i] = file->inode.blocks[i];
+		//sharing the top of the tree shares everything below it
+		BlockPid pid = inode->blocks[i] & ~INODE_UNWRITTEN;
+		if(!(inode->flags & INODE_IS_INLINE) && pid) {
+			if(!block_share(&fs->device, pid)) return 0;
 		}
+	}
+	fs_set_dirty(fs, new_file);
+	*ret_file = new_file;
+	return 1;
+}
+static bool fs_claim_child(FS* fs, File* dir, File* child) {
+	//for removing child, the locks of both are held and the caller has child pinned
+	//the caller's pin has to be the only one; in concurrent mode it is swapped for FILE_PINS_EVICTED,
+	//so that no lookup can pin the child again, see fs_try_pin
+	uint32 pins = 1;
+	bool is_claimed = fs->is_concurrent ? __atomic_compare_exchange_n(&child->pins, &pins, FILE_PINS_EVICTED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) : child->pins == 1;
+	bool ok = is_claimed && fs_load_inode(fs, child);
+	if(ok && fs_is_dir(child)) {
+		//a directory has to be fully cached to know it is empty, unless one of its children already is
+		ok = !child->head_child && fs_restore_dir(fs, child) && !child->head_child;
+	}
+	if(!ok && is_claimed && fs->is_concurrent) __atomic_store_n(&child->pins, 1, __ATOMIC_RELEASE);
+	return ok;
+}
+static void fs_drop_child(FS* fs, File* dir, File* child) {
+	//removes a child claimed by fs_claim_child, its inode is destroyed by the destroyer once the removal is saved
+	//until then the entry is still on the device, so neither its pid nor its blocks can be given to another file
+	ASSERT(fs_is_dir(child) || !__atomic_load_n(&child->views, __ATOMIC_RELAXED));
+	Unlinked* unlinked = cast(Unlinked*, malloc(sizeof(Unlinked)));
+	unlinked->inode = child->inode;
+	unlinked->next = 0;
+	if(child->changes) {
+		//the entries a removed directory still has on the device go away along with it
+		Unlinked** link = &unlinked->next;
+		for_each_lt(i, child->changes->size) {
+			*link = child->changes->changes[i].unlinked;
+			while(*link) link = &(*link)->next;
+		}
+	}
+	DirChange* change = fs_detach_child(fs, dir, child, 0);
+	fs_lock_cache(fs);
+	if(child->lru_prev || fs->lru_tail == child) fs_lru_remove(fs, child);
+	if(fs_is_dir(child)) fs_negative_forget(fs, child->inode.pid);
+	fs_unlock_cache(fs);
+	if(child->delayed) fs_free_delayed(fs, child);
+	if(!fs_is_dir(child)) free(child->tail);
+	free(child->changes);
+	fs_index_publish(fs, &child->index, 0);
+	if(child->flags & FILE_IS_DIRTY) {
+		//it is still on fs->dirty, so it is only freed once fs_save takes it off
+		child->flags |= FILE_IS_REMOVED;
 	} else {
-		*ret_dir = fs_create_file(fs, dir, name, name_size, INODE_DIR);
-		return *ret_dir != 0;
+		//lookups without the lock may still be reading the child, like in fs_evict_children
+		if(child->name_size > FILE_NAME_INLINE) fs_retire(fs, child->name_long, 1);
+		fs_retire(fs, child, 1);
 	}
+	if(change) change->unlinked = unlinked;
+	else fs_queue_unlinked(fs, unlinked);
+}
+static bool fs_remove(FS* fs, File* dir, const char* name, uint16 name_size, bool is_dir) {
+	File* child;
+	if(!fs_is_dir(dir) || !fs_get_any(fs, dir, name, name_size, &child) || !child) return 0;
+	//the child is pinned until both locks are held, so it can't be evicted in between
+	if(!fs->is_concurrent) fs_pin(child);
+	fs_lock_two(fs, dir, child);
+	//the name could have been given to another file while no lock was held
+	bool ok = fs_is_dir(child) == is_dir && fs_index_find(dir->index, name, name_size, child->name_hash) == child && fs_claim_child(fs, dir, child);
+	if(ok) fs_drop_child(fs, dir, child);
+	fs_unlock_two(fs, dir, child);
+	if(!ok) fs_unpin(child);
+	return ok;
+}
+bool fs_unlink(FS* fs, File* dir, const char* name, uint16 name_size) {
+	return fs_remove(fs, dir, name, name_size, 0);
+}
+bool fs_rmdir(FS* fs, File* dir, const char* name, uint16 name_size) {
+	return fs_remove(fs, dir, name, name_size, 1);
+}
+static bool fs_is_below(FS* fs, File* dir, File* file) {
+	//whether file is dir or is somewhere below it; every directory above a cached file is cached, so only those are searched
+	//fs->moves_lock is held, so no directory is moved meanwhile. only one lock is held at a time, and the directories
+	//still to be searched are pinned, so they can't be evicted or removed before they are
+	if(dir == file) return 1;
+	int dirs_size = 1;
+	int dirs_capacity = 16;
+	File** dirs = cast(File**, malloc(dirs_capacity*sizeof(File*)));
+	fs_pin(dir);
+	dirs[0] = dir;
+	bool is_below = 0;
+	while(dirs_size) {
+		dirs_size -= 1;
+		File* parent = dirs[dirs_size];
+		if(!is_below) {
+			fs_lock_read(fs, parent);
+			for(File* child = parent->head_child; child; child = child->next) {
+				if(child == file) is_below = 1;
+				if(!fs_is_dir(child)) continue;
+				if(dirs_size >= dirs_capacity) {
+					dirs_capacity *= 2;
+					dirs = cast(File**, realloc(dirs, dirs_capacity*sizeof(File*)));
+				}
+				fs_pin(child);
+				dirs[dirs_size] = child;
+				dirs_size += 1;
+			}
+			fs_unlock(fs, parent);
+		}
+		fs_unpin(parent);
+	}
+	free(dirs);
+	return is_below;
+}
+bool fs_rename(FS* fs, File* src_dir, const char* name, uint16 name_size, File* dst_dir, const char* new_name, uint16 new_name_size) {
+	if(!fs_is_dir(src_dir) || !fs_is_dir(dst_dir) || !new_name_size || new_name_size > FS_NAME_MAX) return 0;
+	File* file;
+	File* target;
+	if(!fs_get_any(fs, src_dir, name, name_size, &file) || !file) return 0;
+	if(!fs->is_concurrent) fs_pin(file);
+	if(!fs_get_any(fs, dst_dir, new_name, new_name_size, &target)) {
+		fs_unpin(file);
+		return 0;
+	}
+	if(target && !fs->is_concurrent) fs_pin(target);
+	if(target == file) {
+		//it already has the name
+		fs_unpin(file);
+		fs_unpin(target);
+		return 1;
+	}
+	//the directories could otherwise be evicted to make room for the new name, see fs_create_file
+	fs_pin(src_dir);
+	fs_pin(dst_dir);
+	//a directory moved to another one can't end up below itself, and only another such move could change that
+	//before the files are locked, so those moves are made one at a time
+	bool is_moving_dir = fs_is_dir(file) && src_dir != dst_dir;
+	if(is_moving_dir) pthread_mutex_lock(&fs->moves_lock);
+	bool is_below = is_moving_dir && fs_is_below(fs, file, dst_dir);
+	File* files[4] = {src_dir, dst_dir, file, target};
+	int files_size = target ? 4 : 3;
+	fs_lock_files(fs, files, files_size);
+	//either name could have been given to another file while no lock was held
+	uint32 new_hash = fs_hash_filename(FS_HASH_SEED, new_name, new_name_size);
+	bool ok = !is_below && fs_index_find(src_dir->index, name, name_size, file->name_hash) == file && fs_index_find(dst_dir->index, new_name, new_name_size, new_hash) == target;
+	if(ok && target) ok = fs_is_dir(target) == fs_is_dir(file);
+	//the room for the new name is made first, so nothing has changed if there is none
+	bool is_new_text = new_name_size > FILE_NAME_INLINE && file->name_size <= FILE_NAME_INLINE;
+	char* text = 0;
+	if(ok) {
+		text = fs_alloc_filename(fs, file, new_name_size, dst_dir);
+		ok = text != 0;
+	}
+	if(ok && target) {
+		ok = fs_claim_child(fs, dst_dir, target);
+		if(!ok && is_new_text) fs_retire(fs, text, 1);
+	}
+	if(!ok) {
+		fs_unlock_files(fs, files, files_size);
+		if(is_moving_dir) pthread_mutex_unlock(&fs->moves_lock);
+		fs_unpin(src_dir);
+		fs_unpin(dst_dir);
+		fs_unpin(file);
+		if(target) fs_unpin(target);
+		return 0;
+	}
+	if(target) fs_drop_child(fs, dst_dir, target);
+	fs_detach_child(fs, src_dir, file, src_dir != dst_dir || new_hash != file->name_hash);
+	if(fs->is_concurrent) {
+		//lookups still reading the index src_dir had before could otherwise see the name change
+		fs_lock_cache(fs);
+		fs_wait_lookups(fs);
+		fs_unlock_cache(fs);
+	}
+	fs_put_filename(fs, file, text, new_name, new_name_size);
+	file->next = dst_dir->head_child;
+	dst_dir->head_child = file;
+	fs_index_insert(fs, &dst_dir->index, file);
+	//its entry is added to dst_dir's file when dst_dir is next saved, like the entry of a file just created
+	file->flags |= FILE_IS_NEW;
+	fs_add_change(fs, dst_dir, file->name_hash, file->inode.pid, file);
+	fs_lock_cache(fs);
+	fs_negative_remove(fs, dst_dir->inode.pid, new_name, new_name_size, file->name_hash);
+	fs_unlock_cache(fs);
+	fs_unlock_files(fs, files, files_size);
+	if(is_moving_dir) pthread_mutex_unlock(&fs->moves_lock);
+	fs_unpin(src_dir);
+	fs_unpin(dst_dir);
+	fs_unpin(file);
 	return 1;
 }
+bool fs_clone_file(FS* fs, File* dir, const char* name, uint16 name_size, File* file, File** ret_file) {
+	*ret_file = 0;
+	if(fs_is_dir(file)) return 0;
+	ASSERT(fs_is_dir(dir));
+	//the new file isn't handed to anyone until it is a full clone, so both locks are held throughout
+	fs_lock_two(fs, dir, file);
+	bool ok = fs_clone_file_(fs, dir, name, name_size, file, ret_file);
+	if(ok) fs_hand_out(fs, *ret_file);
+	fs_unlock_two(fs, dir, file);
+	return ok;
+}
 
 
+void fs_pin(File* file) {
+	__atomic_fetch_add(&file->pins, 1, __ATOMIC_RELAXED);
+}
+void fs_unpin(File* file) {
+	//releases everything done to the file to whoever sees the pins drop, see fs_can_evict
+	uint32 pins = __atomic_fetch_sub(&file->pins, 1, __ATOMIC_RELEASE);
+	ASSERT(pins > 0);
+}
 
 bool fs_is_dir(File* file) {
 	return file->inode.status == INODE_DIR;
 }
 bool fs_get_first_child(FS* fs, File* dir, File** ret_file) {
 	*ret_file = 0;
+	//the children handed out this way aren't pinned, so they can't be used in concurrent mode
+	ASSERT(!fs->is_concurrent);
+	if(fs->is_concurrent) return 0;
 	if(dir->inode.status == INODE_DIR) {
-		if(!fs_restore_dir(fs, dir)) return 0;
+		fs_touch_dir(fs, dir);
+		if(!fs_load_inode(fs, dir) || !fs_restore_dir(fs, dir)) return 0;
 		*ret_file = dir->head_child;
 	}
 	return 1;
@@ -353,59 +2576,580 @@ File* fs_get_next_child(FS* fs, File* dir, File* child) {
 	return child->next;
 }
 
+static void fs_pid_push(PidList* list, INodePid pid) {
+	if(list->size >= list->capacity) {
+		list->capacity = list->capacity ? 2*list->capacity : 16;
+		list->pids = cast(INodePid*, realloc(list->pids, list->capacity*sizeof(INodePid)));
+	}
+	list->pids[list->size] = pid;
+	list->size += 1;
+}
+bool fs_open_reader(FS* fs, File* dir, DirReader** ret_reader) {
+	*ret_reader = 0;
+	if(!fs_is_dir(dir) || !fs_lock_loaded(fs, dir, 0)) return 0;
+	fs_unlock(fs, dir);
+	DirReader* reader = cast(DirReader*, malloc(sizeof(DirReader)));
+	fs_pin(dir);
+	reader->dir = dir;
+	reader->change_i = 0;
+	reader->added = (PidList){0, 0, 0};
+	reader->is_changes_done = 0;
+	reader->is_leaves_done = 0;
+	reader->added_sorted = 0;
+	//differs from dir->saves, so the first leaf is found from hash 0
+	reader->saves = dir->saves - 1;
+	reader->hash = 0;
+	reader->run = (PidList){0, 0, 0};
+	reader->is_refound = 0;
+	reader->offset = 0;
+	reader->removed_size = 0;
+	reader->removed = 0;
+	reader->path.depth = 0;
+	*ret_reader = reader;
+	return 1;
+}
+static bool fs_read_dir_(FS* fs, DirReader* reader, DirEntry** ret_entry) {
+	*ret_entry = 0;
+	File* dir = reader->dir;
+	DirEntry* ret = &reader->entry;
+	if(!reader->is_changes_done) {
+		DirChanges* changes = dir->changes;
+		//reader->saves stays one behind dir->saves until the first leaf is read
+		if(reader->saves + 1 != dir->saves) {
+			//a save reordered the list and may have written some of it, the children written are read from the file
+			//instead, so the list is walked again and only the children not read yet are read from it
+			reader->saves = dir->saves - 1;
+			reader->change_i = 0;
+			if(reader->added.size) qsort(reader->added.pids, reader->added.size, sizeof(INodePid), fs_cmp_pid);
+			reader->added_sorted = reader->added.size;
+		}
+		while(changes && reader->change_i < changes->size) {
+			File* child = changes->changes[reader->change_i].file;
+			reader->change_i += 1;
+			if(!child) continue;
+			if(reader->added_sorted && bsearch(&child->inode.pid, reader->added.pids, reader->added_sorted, sizeof(INodePid), fs_cmp_pid)) continue;
+			fs_pid_push(&reader->added, child->inode.pid);
+			fs_get_filename(child, reader->name);
+			ret->name = reader->name;
+			ret->name_size = child->name_size;
+			ret->is_dir = fs_is_dir(child);
+			ret->id = child->inode.pid;
+			*ret_entry = ret;
+			return 1;
+		}
+		reader->is_changes_done = 1;
+		if(reader->added.size) qsort(reader->added.pids, reader->added.size, sizeof(INodePid), fs_cmp_pid);
+	}
+	while(!reader->is_leaves_done) {
+		byte* mem = reader->path.mem[reader->path.depth];
+		DirNodeHeader* header = cast(DirNodeHeader*, mem);
+		if(reader->saves != dir->saves) {
+			//the tree may have been rebuilt since the leaf was read, so it is found again from the last entry read
+			if(!dir->inode.mem_size) {
+				reader->is_leaves_done = 1;
+				break;
+			}
+			if(!fs_dir_descend(fs, dir, reader->hash, &reader->path)) return 0;
+			reader->saves = dir->saves;
+			reader->offset = reader->path.offsets[reader->path.depth];
+			reader->is_refound = 1;
+			free(reader->removed);
+			reader->removed_size = fs_get_removed(dir, &reader->removed);
+			continue;
+		}
+		if(reader->offset >= header->mem_size) {
+			if(!header->next) {
+				reader->is_leaves_done = 1;
+				break;
+			}
+			reader->path.nodes[reader->path.depth] = header->next;
+			if(!fs_dir_read_node(fs, dir, header->next, mem)) return 0;
+			reader->offset = sizeof(DirNodeHeader);
+			free(reader->removed);
+			reader->removed_size = fs_get_removed(dir, &reader->removed);
+			continue;
+		}
+		DirEntryHeader entry;
+		memcpy(&entry, mem + reader->offset, SIZEOF_HEADER);
+		const char* name = cast(const char*, mem + reader->offset + SIZEOF_HEADER);
+		reader->offset += SIZEOF_HEADER + entry.name_size;
+		if(entry.hash != reader->hash) {
+			reader->hash = entry.hash;
+			reader->run.size = 0;
+			reader->is_refound = 0;
+		} else if(reader->is_refound) {
+			bool is_read = 0;
+			for_each_lt(i, reader->run.size) {
+				if(reader->run.pids[i] == entry.pid) is_read = 1;
+			}
+			if(is_read) continue;
+		}
+		if(fs_has_key(reader->removed, reader->removed_size, &entry)) continue;
+		if(reader->added.size && bsearch(&entry.pid, reader->added.pids, reader->added.size, sizeof(INodePid), fs_cmp_pid)) continue;
+		fs_pid_push(&reader->run, entry.pid);
+		ret->name = name;
+		ret->name_size = entry.name_size;
+		ret->is_dir = entry.status == INODE_DIR;
+		ret->id = entry.pid;
+		*ret_entry = ret;
+		return 1;
+	}
+	return 1;
+}
+bool fs_read_dir(FS* fs, DirReader* reader, DirEntry** ret_entry) {
+	//the directory is only read, so readers of the same directory and lookups of cached names run in parallel
+	fs_lock_read(fs, reader->dir);
+	bool ok = fs_read_dir_(fs, reader, ret_entry);
+	fs_unlock(fs, reader->dir);
+	return ok;
+}
+void fs_close_reader(FS* fs, DirReader* reader) {
+	fs_unpin(reader->dir);
+	free(reader->added.pids);
+	free(reader->run.pids);
+	free(reader->removed);
+	free(reader);
+}
+
 
 uint fs_filename_size(File* file) {
 	return file->name_size;
 }
 void fs_get_filename(File* file, char* ret_name) {
-	Filename* cur_filename = file->name;
-	uint cur_left = file->name_size;
-	while(cur_left > FILENAME_TEXT_SIZE) {
-		memcpy(ret_name, &cur_filename->text, FILENAME_TEXT_SIZE);
-		cur_left -= FILENAME_TEXT_SIZE;
-		ret_name += FILENAME_TEXT_SIZE;
-		cur_filename = cur_filename->next;
-	}
-	memcpy(ret_name, &cur_filename->text, cur_left);
-}
-void fs_set_filename(FS* fs, File* file, const char* name, uint16 name_size) {
-	if(!name_size) return;
-	Filename* cur_filename = file->name;
-	uint cur_left = name_size;
-	if(!cur_filename) {
-		cur_filename = mam_pool_alloc(Filename, fs->dir_cache);
-		cur_filename->next = 0;
-		file->name = cur_filename;
-	}
-	//copy the filename into the dir cache
-	while(cur_left > FILENAME_TEXT_SIZE) {
-		memcpy(&cur_filename->text, name, FILENAME_TEXT_SIZE);
-		cur_left -= FILENAME_TEXT_SIZE;
-		name += FILENAME_TEXT_SIZE;
-		cur_filename = cur_filename->next;
-		if(!cur_filename) {
-			cur_filename = mam_pool_alloc(Filename, fs->dir_cache);
-			cur_filename->next = 0;
-		}
-	}
-	memcpy(&cur_filename->text, name, cur_left);
-	file->name_size = name_size;
+	memcpy(ret_name, fs_filename_text(file), file->name_size);
 }
 
 
-uint64 fs_get_size(File* file) {
-	return file->inode.mem_size;
+bool fs_get_size(FS* fs, File* file, uint64* ret_size) {
+	if(!fs_lock_loaded(fs, file, 0)) return 0;
+	*ret_size = file->inode.mem_size;
+	fs_unlock(fs, file);
+	return 1;
 }
-bool fs_set_size(FS* fs, File* file, uint64 mem_size) {
-	file->flags |= FILE_IS_DIRTY;
+static bool fs_set_size_(FS* fs, File* file, uint64 mem_size) {
+	//a view of the freed blocks would read whatever they are given to next
+	ASSERT(!__atomic_load_n(&file->views, __ATOMIC_RELAXED));
+	fs_set_dirty(fs, file);
+	file->writes += 1;
+	if(!fs_drop_tail(fs, file)) return 0;
+	DelayedData* delayed = file->delayed;
+	if(delayed && mem_size < file->inode.mem_size) {
+		//drop the blocks held in memory past the new end, and clear the end of the last one
+		int block_size = fs->device.block_size;
+		int i = fs_find_delayed(delayed, (mem_size + block_size - 1)/block_size);
+		for_each_in_range(j, i, delayed->blocks_size - 1) {
+			free(delayed->blocks[j].mem);
+		}
+		fs->delayed_blocks_size -= delayed->blocks_size - i;
+		delayed->blocks_size = i;
+		if(i > 0 && delayed->blocks[i - 1].block_offset == mem_size/block_size) {
+			int internal_offset = mem_size%block_size;
+			memzero(&delayed->blocks[i - 1].mem[internal_offset], block_size - internal_offset);
+		}
+	}
 	return inode_set_size(&fs->device, &file->inode, mem_size);
 }
+static bool fs_lock_unflushed(FS* fs, File* file) {
+	//for functions that only read the file, but need the last block appended to be on the device first
+	if(!fs_lock_loaded(fs, file, 0)) return 0;
+	if(!file->tail || !file->tail->is_dirty) return 1;
+	fs_unlock(fs, file);
+	return fs_lock_loaded(fs, file, 1);
+}
+static bool fs_read_(FS* fs, File* file, uint64 mem_offset, void* mem, uint64 mem_size) {
+	if(!fs_flush_tail(fs, file)) return 0;
+	if(!inode_read(&fs->device, &file->inode, mem_offset, mem, mem_size)) return 0;
+	if(file->delayed) {
+		fs_read_delayed(fs, file, mem_offset, mem, mem_size);
+	}
+	return 1;
+}
+static bool fs_write_(FS* fs, File* file, uint64 mem_offset, const void* mem, uint64 mem_size) {
+	ASSERT(!__atomic_load_n(&file->views, __ATOMIC_RELAXED));
+	fs_set_dirty(fs, file);
+	file->writes += 1;
+	if(!fs_drop_tail(fs, file)) return 0;
+	if(fs->is_delayed_alloc) {
+		return fs_write_delayed(fs, file, mem_offset, mem, mem_size);
+	}
+	return inode_write(&fs->device, &file->inode, mem_offset, mem, mem_size);
+}
+
+static bool fs_append_(FS* fs, File* file, const void* mem, uint64 mem_size) {
+	ASSERT(!__atomic_load_n(&file->views, __ATOMIC_RELAXED));
+	if(fs->is_delayed_alloc) {
+		//delayed allocation already holds new blocks in memory
+		return fs_write_(fs, file, file->inode.mem_size, mem, mem_size);
+	}
+	if(!mem_size) return 1;
+	BlockDevice* device = &fs->device;
+	INode* inode = &file->inode;
+	fs_set_dirty(fs, file);
+	file->writes += 1;
+	uint64 mem_offset = inode->mem_size;
+	if(mem_offset + mem_size < mem_size) {ASSERT(0); return 0;}//catch overflows
+	if(!inode_set_size(device, inode, mem_offset + mem_size)) return 0;
+	if(inode->flags & INODE_IS_INLINE) {
+		return inode_write(device, inode, mem_offset, mem, mem_size);
+	}
+	int block_size = device->block_size;
+	int64 block_offset = mem_offset/block_size;
+	int fill = mem_offset%block_size;
+	FileTail* tail = file->tail;
+	if(!tail) {
+		tail = cast(FileTail*, malloc(sizeof(FileTail) + block_size));
+		tail->cursor.block_offset = -1;
+		tail->is_dirty = 0;
+		file->tail = tail;
+	}
+	if(tail->cursor.block_offset != block_offset) {
+		//the tail has moved since the last append, so we bring the new last block into memory
+		if(!fs_flush_tail(fs, file)) return 0;
+		if(!inode_cursor_seek(device, inode, &tail->cursor, block_offset)) return 0;
+		memzero(tail->mem, block_size);
+		BlockPid pid = tail->cursor.block_path_pids[0];
+		if(fill > 0 && pid && !(pid & INODE_UNWRITTEN)) {
+			if(!block_reads(device, pid, 0, tail->mem, fill)) return 0;
+		}
+	} else if(tail->cursor.level != inode->level) {
+		//the tree grew a level, so the cached path is no longer valid
+		if(!inode_cursor_seek(device, inode, &tail->cursor, block_offset)) return 0;
+	}
+	const byte* cur_mem = cast(const byte*, mem);
+	uint64 mem_left_size = mem_size;
+	while(mem_left_size > 0) {
+		uint64 cur_size = block_size - fill;
+		if(cur_size > mem_left_size) cur_size = mem_left_size;
+		memcpy(&tail->mem[fill], cur_mem, cur_size);
+		tail->is_dirty = 1;
+		fill += cur_size;
+		cur_mem += cur_size;
+		mem_left_size -= cur_size;
+		if(fill == block_size) {
+			//the block is full, write it and move on to the next one
+			//unless this was the last of mem, since the tree may not reach past it yet, the next append seeks instead
+			if(!fs_flush_tail(fs, file)) return 0;
+			if(!mem_left_size) break;
+			if(!inode_cursor_next(device, inode, &tail->cursor)) return 0;
+			memzero(tail->mem, block_size);
+			fill = 0;
+		}
+	}
+	return 1;
+}
+static bool fs_preallocate_(FS* fs, File* file, uint64 mem_offset, uint64 mem_size) {
+	BlockDevice* device = &fs->device;
+	INode* inode = &file->inode;
+	if(mem_offset + mem_size < mem_size) {ASSERT(0); return 0;}//catch overflows
+	fs_set_dirty(fs, file);
+	file->writes += 1;
+	//blocks held in memory would otherwise be given blocks of their own when they are flushed
+	if(!fs_drop_tail(fs, file) || !fs_flush_delayed(fs, file)) return 0;
+	if(mem_offset + mem_size > inode->mem_size) {
+		if(!inode_set_size(device, inode, mem_offset + mem_size)) return 0;
+	}
+	if(!mem_size || (inode->flags & INODE_IS_INLINE)) return 1;
+	int block_size = device->block_size;
+	int64 block_offset = mem_offset/block_size;
+	int64 blocks_size = (mem_offset + mem_size + block_size - 1)/block_size - block_offset;
+	BlockPid* pids = cast(BlockPid*, malloc(blocks_size*sizeof(BlockPid)));
+	bool ok = inode_get_blocks(device, inode, block_offset, blocks_size, pids);
+	int64 i = 0;
+	while(ok && i < blocks_size) {
+		if(pids[i]) {
+			i += 1;
+			continue;
+		}
+		//find the run of missing blocks starting at i
+		int64 run = 1;
+		while(i + run < blocks_size && !pids[i + run]) {
+			run += 1;
+		}
+		//give it as few runs of consecutive data blocks as the device allows
+		int64 j = 0;
+		while(ok && j < run) {
+			int64 alloc_size;
+			BlockPid pid = block_alloc_run(device, run - j, &alloc_size);
+			if(!pid) {
+				ok = 0;
+				break;
+			}
+			for_each_lt(k, alloc_size) {
+				pids[i + j + k] = (pid + k) | INODE_UNWRITTEN;
+			}
+			ok = inode_set_blocks(device, inode, block_offset + i + j, alloc_size, &pids[i + j]);
+			j += alloc_size;
+		}
+		i += run;
+	}
+	free(pids);
+	return ok;
+}
+//the file's lock is held for all of these, the write lock unless they only read it
+bool fs_set_size(FS* fs, File* file, uint64 mem_size) {
+	if(!fs_lock_loaded(fs, file, 1)) return 0;
+	bool ok = fs_set_size_(fs, file, mem_size);
+	fs_unlock(fs, file);
+	return ok;
+}
 bool fs_read (FS* fs, File* file, uint64 mem_offset,       void* mem, uint64 mem_size) {
-	return inode_read(&fs->device, &file->inode, mem_offset, mem, mem_size);
+	if(!fs_lock_unflushed(fs, file)) return 0;
+	bool ok = fs_read_(fs, file, mem_offset, mem, mem_size);
+	fs_unlock(fs, file);
+	return ok;
 }
 bool fs_write(FS* fs, File* file, uint64 mem_offset, const void* mem, uint64 mem_size) {
-	file->flags |= FILE_IS_DIRTY;
-	return inode_write(&fs->device, &file->inode, mem_offset, mem, mem_size);
+	if(!fs_lock_loaded(fs, file, 1)) return 0;
+	bool ok = fs_write_(fs, file, mem_offset, mem, mem_size);
+	fs_unlock(fs, file);
+	return ok;
+}
+bool fs_append(FS* fs, File* file, const void* mem, uint64 mem_size) {
+	if(!fs_lock_loaded(fs, file, 1)) return 0;
+	bool ok = fs_append_(fs, file, mem, mem_size);
+	fs_unlock(fs, file);
+	return ok;
+}
+bool fs_preallocate(FS* fs, File* file, uint64 mem_offset, uint64 mem_size) {
+	if(!fs_lock_loaded(fs, file, 1)) return 0;
+	bool ok = fs_preallocate_(fs, file, mem_offset, mem_size);
+	fs_unlock(fs, file);
+	return ok;
+}
+
+bool fs_set_delayed_alloc(FS* fs, bool is_enabled) {
+	if(fs->is_concurrent) return 1;
+	if(fs->is_delayed_alloc && !is_enabled) {
+		if(!fs_flush_all_delayed_(fs, &fs->root)) return 0;
+	}
+	fs->is_delayed_alloc = is_enabled;
+	return 1;
+}
+static bool fs_get_extents_(FS* fs, File* file, int64* ret_blocks_size, int64* ret_extents_size) {
+	if(!fs_flush_delayed(fs, file) || !fs_flush_tail(fs, file)) return 0;
+	INode* inode = &file->inode;
+	if(inode->flags & INODE_IS_INLINE) return 1;
+	int block_size = fs->device.block_size;
+	int64 blocks_size = (inode->mem_size + block_size - 1)/block_size;
+	BlockPid* pids = cast(BlockPid*, malloc(blocks_size*sizeof(BlockPid)));
+	bool ok = inode_get_blocks(&fs->device, inode, 0, blocks_size, pids);
+	if(ok) {
+		BlockPid pre_pid = 0;
+		for_each_lt(i, blocks_size) {
+			BlockPid pid = pids[i] & ~INODE_UNWRITTEN;
+			if(pid) {
+				*ret_blocks_size += 1;
+				if(pid != pre_pid + 1) {
+					*ret_extents_size += 1;
+				}
+			}
+			pre_pid = pid;
+		}
+	}
+	free(pids);
+	return ok;
+}
+bool fs_get_extents(FS* fs, File* file, int64* ret_blocks_size, int64* ret_extents_size) {
+	*ret_blocks_size = 0;
+	*ret_extents_size = 0;
+	if(!fs_lock_unflushed(fs, file)) return 0;
+	bool ok = fs_get_extents_(fs, file, ret_blocks_size, ret_extents_size);
+	fs_unlock(fs, file);
+	return ok;
+}
+
+bool fs_acquire_view(FS* fs, File* file, uint64 mem_offset, uint64 mem_size, const void** ret_mem, uint64* ret_size) {
+	//views read straight from the device, so anything held in memory has to get there first
+	if(!fs_lock_unflushed(fs, file)) return 0;
+	bool ok = fs_flush_delayed(fs, file) && fs_flush_tail(fs, file) && inode_view(&fs->device, &file->inode, mem_offset, mem_size, ret_mem, ret_size);
+	if(ok) {
+		fs_pin(file);
+		__atomic_fetch_add(&file->views, 1, __ATOMIC_RELAXED);
+	}
+	fs_unlock(fs, file);
+	if(!ok) return 0;
+	__atomic_fetch_add(&fs->view_bytes, *ret_size, __ATOMIC_RELAXED);
+	return 1;
+}
+void fs_release_view(FS* fs, File* file, const void* mem) {
+	//views point straight into the device mapping or the cached inode, so only the count of them is given back
+	uint32 views = __atomic_fetch_sub(&file->views, 1, __ATOMIC_RELAXED);
+	ASSERT(views > 0);
+	fs_unpin(file);
+}
+
+
+static FileHandle* fs_get_handle(FS* fs, int handle) {
+	ASSERT(handle >= 0 && handle < fs->handles_size);
+	FileHandle* ret = &fs->handle_chunks[handle/FS_HANDLE_CHUNK_SIZE][handle%FS_HANDLE_CHUNK_SIZE];
+	ASSERT(ret->file);
+	return ret;
+}
+bool fs_open(FS* fs, File* file, int* ret_handle) {
+	*ret_handle = -1;
+	if(fs_is_dir(file)) return 0;
+	pthread_mutex_lock(&fs->handles_lock);
+	int i = fs->handles_free;
+	if(i >= 0) {
+		fs->handles_free = fs->handle_chunks[i/FS_HANDLE_CHUNK_SIZE][i%FS_HANDLE_CHUNK_SIZE].next_free;
+	} else if(fs->handles_size < FS_HANDLE_CHUNKS_MAX*FS_HANDLE_CHUNK_SIZE) {
+		i = fs->handles_size;
+		if(!fs->handle_chunks) fs->handle_chunks = cast(FileHandle**, calloc(FS_HANDLE_CHUNKS_MAX, sizeof(FileHandle*)));
+		FileHandle** chunk = &fs->handle_chunks[i/FS_HANDLE_CHUNK_SIZE];
+		if(!*chunk) *chunk = cast(FileHandle*, malloc(FS_HANDLE_CHUNK_SIZE*sizeof(FileHandle)));
+		fs->handles_size += 1;
+	}
+	pthread_mutex_unlock(&fs->handles_lock);
+	if(i < 0) return 0;
+	FileHandle* handle = &fs->handle_chunks[i/FS_HANDLE_CHUNK_SIZE][i%FS_HANDLE_CHUNK_SIZE];
+	int block_size = fs->device.block_size;
+	fs_pin(file);
+	handle->file = file;
+	handle->next_free = -1;
+	handle->offset = 0;
+	handle->writes = 0;
+	handle->map_offset = -1;
+	handle->mem_offset = -1;
+	//map and mem share an allocation
+	handle->map = cast(BlockPid*, malloc(2*block_size));
+	handle->mem = ptr_add(byte, handle->map, block_size);
+	*ret_handle = i;
+	return 1;
+}
+void fs_close(FS* fs, int handle) {
+	FileHandle* cur_handle = fs_get_handle(fs, handle);
+	fs_unpin(cur_handle->file);
+	free(cur_handle->map);
+	cur_handle->file = 0;
+	pthread_mutex_lock(&fs->handles_lock);
+	cur_handle->next_free = fs->handles_free;
+	fs->handles_free = handle;
+	pthread_mutex_unlock(&fs->handles_lock);
+}
+void fs_seek(FS* fs, int handle, uint64 mem_offset) {
+	fs_get_handle(fs, handle)->offset = mem_offset;
+}
+uint64 fs_tell(FS* fs, int handle) {
+	return fs_get_handle(fs, handle)->offset;
+}
+static bool fs_handle_get_pid(FS* fs, FileHandle* handle, int64 block_offset, BlockPid* ret_pid) {
+	//the pids of blocks held by the same pointer block as the last one are found without going to the device
+	BlockDevice* device = &fs->device;
+	INode* inode = &handle->file->inode;
+	if(inode->level == 0) {
+		*ret_pid = inode->blocks[block_offset];
+		return 1;
+	}
+	int block_base = device->block_size/sizeof(BlockPid);
+	if(handle->map_offset < 0 || handle->cursor.level != inode->level || block_offset < handle->map_offset || block_offset >= handle->map_offset + block_base) {
+		handle->map_offset = -1;
+		if(!inode_cursor_seek(device, inode, &handle->cursor, block_offset)) return 0;
+		BlockPid map_pid = handle->cursor.block_path_pids[1];
+		if(map_pid) {
+			if(!block_read(device, map_pid, handle->map)) return 0;
+		} else {
+			memzero(handle->map, device->block_size);
+		}
+		handle->map_offset = block_offset - handle->cursor.block_path[0];
+	}
+	*ret_pid = handle->map[block_offset - handle->map_offset];
+	return 1;
+}
+static bool fs_read_next_(FS* fs, FileHandle* handle, byte* mem, uint64 mem_size) {
+	BlockDevice* device = &fs->device;
+	File* file = handle->file;
+	if(!fs_flush_tail(fs, file)) return 0;
+	if(file->delayed || (file->inode.flags & INODE_IS_INLINE) || (device->io_pool && mem_size >= 2*device->io_split_size)) {
+		//there is nothing to keep in memory for these, or the read is large enough to be split across the I/O threads
+		return fs_read_(fs, file, handle->offset, mem, mem_size);
+	}
+	if(handle->writes != file->writes) {
+		handle->writes = file->writes;
+		handle->map_offset = -1;
+		handle->mem_offset = -1;
+	}
+	int block_size = device->block_size;
+	uint64 mem_offset = handle->offset;
+	while(mem_size > 0) {
+		int64 block_offset = mem_offset/block_size;
+		int internal_offset = mem_offset%block_size;
+		if(internal_offset == 0 && mem_size >= block_size && block_offset != handle->mem_offset) {
+			//whole blocks are read straight into mem, a run of consecutive ones with a single I/O
+			int64 blocks_size = mem_size/block_size;
+			BlockPid pid;
+			if(!fs_handle_get_pid(fs, handle, block_offset, &pid)) return 0;
+			if(pid & INODE_UNWRITTEN) pid = 0;
+			int64 run = 1;
+			while(run < blocks_size) {
+				BlockPid next_pid;
+				if(!fs_handle_get_pid(fs, handle, block_offset + run, &next_pid)) return 0;
+				if(next_pid & INODE_UNWRITTEN) next_pid = 0;
+				if(pid ? next_pid != pid + run : next_pid != 0) break;
+				run += 1;
+			}
+			if(pid) {
+				if(!block_read_run(device, pid, run, mem)) return 0;
+			} else {
+				//missing and unwritten blocks read as zeros
+				memzero(mem, run*block_size);
+			}
+			mem += run*block_size;
+			mem_offset += run*block_size;
+			mem_size -= run*block_size;
+			continue;
+		}
+		if(block_offset != handle->mem_offset) {
+			//the rest of a block read in part is kept, so the reads after this one don't go to the device for it
+			BlockPid pid;
+			if(!fs_handle_get_pid(fs, handle, block_offset, &pid)) return 0;
+			if(pid && !(pid & INODE_UNWRITTEN)) {
+				if(!block_read(device, pid, handle->mem)) return 0;
+			} else {
+				memzero(handle->mem, block_size);
+			}
+			handle->mem_offset = block_offset;
+		}
+		uint64 cur_size = block_size - internal_offset;
+		if(cur_size > mem_size) cur_size = mem_size;
+		memcpy(mem, &handle->mem[internal_offset], cur_size);
+		mem += cur_size;
+		mem_offset += cur_size;
+		mem_size -= cur_size;
+	}
+	return 1;
+}
+bool fs_read_next(FS* fs, int handle, void* mem, uint64 mem_size, uint64* ret_size) {
+	*ret_size = 0;
+	FileHandle* cur_handle = fs_get_handle(fs, handle);
+	File* file = cur_handle->file;
+	if(!fs_lock_unflushed(fs, file)) return 0;
+	uint64 file_size = file->inode.mem_size;
+	if(cur_handle->offset < file_size && mem_size > file_size - cur_handle->offset) mem_size = file_size - cur_handle->offset;
+	bool ok = 1;
+	if(cur_handle->offset < file_size && mem_size) {
+		ok = fs_read_next_(fs, cur_handle, cast(byte*, mem), mem_size);
+		if(ok) {
+			cur_handle->offset += mem_size;
+			*ret_size = mem_size;
+		}
+	}
+	fs_unlock(fs, file);
+	return ok;
+}
+bool fs_write_next(FS* fs, int handle, const void* mem, uint64 mem_size) {
+	FileHandle* cur_handle = fs_get_handle(fs, handle);
+	File* file = cur_handle->file;
+	if(!fs_lock_loaded(fs, file, 1)) return 0;
+	bool ok;
+	if(cur_handle->offset == file->inode.mem_size) {
+		//the tail already keeps the path to the last block, see fs_append
+		ok = fs_append_(fs, file, mem, mem_size);
+	} else {
+		ok = fs_write_(fs, file, cur_handle->offset, mem, mem_size);
+	}
+	if(ok) cur_handle->offset += mem_size;
+	fs_unlock(fs, file);
+	return ok;
 }
 
 
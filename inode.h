@@ -23,98 +23,351 @@ enum INodeStatus {
 	INODE_FILE,
 };
 #define BLOCKS_PER_INODE 13
+//when INODE_IS_INLINE is set, the data of the inode is stored directly in the blocks array instead of in data blocks
+//this is the case for every inode whose mem_size has never exceeded INODE_INLINE_SIZE
+#define INODE_IS_INLINE 0b1
 typedef struct INode {
 	INodePid pid;
 	uint16 level;
 	uint16 status;
-	uint32 _padding;
+	uint32 flags;
 	uint64 mem_size;
 	BlockPid blocks[BLOCKS_PER_INODE];
 } INode;
+#define INODE_INLINE_SIZE (BLOCKS_PER_INODE*sizeof(BlockPid))
+//a data block that has been allocated but never written to has INODE_UNWRITTEN set on its pid wherever it is referenced
+//it reads as zeros without the block ever being zeroed on the device, the bit is cleared when the block is first written
+//INODE_HAS_UNWRITTEN is set on any inode that might have such a block
+#define INODE_UNWRITTEN (((BlockPid)1)<<62)
+#define INODE_HAS_UNWRITTEN 0b10
 
-typedef struct INodeAllocator {
-	INodePid next_inode;
-	int inodes_per_block;
+//every inode block has an INodeMap in memory, a bitmap of which of its inodes are free (bit set) or in use
+//the maps are kept sorted by block in the maps array, and are persisted all at once by inode_savefs into map_inode
+typedef uint64 INodeMap;//[0] is the block pid, [1..] are the free bits
+#define INODE_MAP_WORDS(inodes_per_block) (1 + ((inodes_per_block) + 63)/64)
+
+//the inode table cache holds recently used inode blocks, inode_save only writes to the cache
+//inode_flush then writes each dirty inode block once, no matter how many of its inodes were saved
+#define INODE_CACHE_SIZE 256//must be a power of 2
+#define INODE_CACHE_LOAD_MAX (3*INODE_CACHE_SIZE/4)
+typedef struct INodeCacheEntry {
+	BlockPid block;//0 if the entry is empty
+	bool is_dirty;
+	uint64 dirty_inodes[(INODE_MASK + 1)/64];
+} INodeCacheEntry;
+
+typedef union INodeAllocator {
+	struct {
+		int inodes_per_block;
+		INode map_inode;
+		INode refs_inode;//holds the BlockRef of every block of the device with more than 1 reference, see block_share
+		INodeMap* maps;
+		int maps_size;
+		int maps_capacity;
+		int map_words;
+		int first_free_map;//no map below this index has a free inode
+		bool is_dirty;
+		INodeCacheEntry* cache;
+		byte* cache_mem;//the contents of cache[i] are at cache_mem[i*block_size]
+		int cache_size;
+		//inodes_flushed/inode_block_writes is the average number of inodes written per inode block write
+		uint64 inodes_flushed;
+		uint64 inode_block_writes;
+		pthread_mutex_t mutex;//held by the functions that use the maps or the cache, see inode_save
+	};
+	struct {
+		struct {
+			int inodes_per_block;
+			INode map_inode;
+			INode refs_inode;
+		} persistent_data;
+	};
 } INodeAllocator;
 
+//a cursor caches the path through the inode's tree to one of its blocks of data
+//so that following blocks can be reached without walking down from the root again
+#define INODE_LEVEL_MAX 8
+typedef struct INodeCursor {
+	int level;//the level of the inode when the cursor was positioned, the cursor is stale if this changes
+	int64 block_offset;
+	int block_path[INODE_LEVEL_MAX + 1];
+	BlockPid block_path_pids[INODE_LEVEL_MAX + 1];//block_path_pids[0] is the pid of the data block, or 0 if it doesn't exist
+} INodeCursor;
+
 //API subject to change, see shell.c for an example of it's usage
 
 #define INODE_BLOCK_SIZE_MAX ((INODE_MASK + 1)*sizeof(INode))
 #define INODE_BLOCK_SIZE_MIN sizeof(INode)
 void inode_initfs   (INodeAllocator* allocator, int block_size);
 bool inode_mountfs  (BlockDevice* device, INodeAllocator* allocator);
-bool inode_unmountfs(BlockDevice* device, INodeAllocator* allocator);
+bool inode_savefs   (BlockDevice* device, INodeAllocator* allocator);
+bool inode_unmountfs(BlockDevice* device, INodeAllocator* allocator);//calls savefs
+bool inode_flush    (BlockDevice* device, INodeAllocator* allocator);
+//writes every inode block in the inode table cache that has been saved to, called by savefs
 
 bool inode_create (BlockDevice* device, INodeAllocator* allocator, uint64 mem_size, INode* inode);//calls save
 bool inode_destroy(BlockDevice* device, INodeAllocator* allocator, INode* inode);//calls save
-bool inode_save   (BlockDevice* device,         const INode* inode);
-bool inode_restore(BlockDevice* device, INodePid pid, INode* inode);
+bool inode_save   (BlockDevice* device, INodeAllocator* allocator, const INode* inode);//does not write to the device until inode_flush
+bool inode_restore(BlockDevice* device, INodeAllocator* allocator, INodePid pid, INode* inode);
+//the four functions above and inode_flush can be called from any number of threads at once
+//every other function must not be called on the same inode from two threads at once
 
 bool inode_set_size(BlockDevice* device, INode* inode, uint64 mem_size);
 
 bool inode_write   (BlockDevice* device, INode* inode, uint64 mem_offset, const void* mem, uint64 mem_size);
 bool inode_read    (BlockDevice* device, INode* inode, uint64 mem_offset,       void* mem, uint64 mem_size);
+bool inode_get_blocks(BlockDevice* device, INode* inode, int64 block_offset, int64 blocks_size,       BlockPid* ret_pids);
+//sets ret_pids to the pids of the data blocks holding the blocks_size blocks of data starting at block block_offset
+//the pid of a block of data that was never allocated is set to 0, and one that was never written to has INODE_UNWRITTEN set
+//the inode must not be inline
+bool inode_set_blocks(BlockDevice* device, INode* inode, int64 block_offset, int64 blocks_size, const BlockPid* pids);
+//makes pids the data blocks of the blocks_size blocks of data starting at block block_offset, allocating any missing pointer blocks
+//the caller allocates and writes pids, or sets INODE_UNWRITTEN on them if they aren't written
+//the inode must be large enough to contain the blocks and must not be inline
+bool inode_cursor_seek   (BlockDevice* device, INode* inode, INodeCursor* cursor, int64 block_offset);
+bool inode_cursor_next   (BlockDevice* device, INode* inode, INodeCursor* cursor);
+//positions the cursor at the given block of data, or moves it to the next one, the inode must not be inline
+bool inode_cursor_set_pid(BlockDevice* device, INode* inode, INodeCursor* cursor, BlockPid pid);
+//makes pid the data block at the cursor's position, the caller allocates and writes pid
+bool inode_view    (BlockDevice* device, INode* inode, uint64 mem_offset, uint64 mem_size, const void** ret_mem, uint64* ret_size);
+//sets ret_mem to a read-only pointer to the inode's data at mem_offset, without copying it
+//ret_size is set to the number of bytes it points to, this is the longest span up to mem_size that is contiguous in memory
+//ret_mem is valid until the inode or its blocks are written to; returns 0 if the device is not mapped into memory
 
 #endif
 
 #ifdef INODE_IMPLEMENTATION
 #undef INODE_IMPLEMENTATION
 
-static INodePid inode_alloc(BlockDevice* device, INodeAllocator* allocator) {
-	INodePid ret_inode = allocator->next_inode;
-	if(ret_inode) {
-		uint inode_i = ret_inode&INODE_MASK;
-		BlockPid block = ret_inode>>INODE_SHIFT;
-		INodePid next;
-		if(block_reads(device, block, inode_i*sizeof(INode), &next, sizeof(INodePid))) {
-			allocator->next_inode = next;
-		} else return 0;
-	} else {
-		BlockPid block = block_alloc(device);
-		if(!block) return 0;
-		INodePid base_pid = block<<INODE_SHIFT;
-		int i = 1;
-		while(i < allocator->inodes_per_block - 1) {
-			INodePid next = base_pid|(i + 1);
-			if(!block_writes(device, block, i*sizeof(INode), &next, sizeof(INodePid))) {
-				block_free(device, block);
-				return 0;
+static void inode_cache_reset(INodeAllocator* allocator) {
+	allocator->cache_size = 0;
+	for_each_lt(i, INODE_CACHE_SIZE) {
+		allocator->cache[i].block = 0;
+	}
+}
+static bool inode_flush_(BlockDevice* device, INodeAllocator* allocator) {
+	int block_size = device->block_size;
+	for_each_lt(i, INODE_CACHE_SIZE) {
+		INodeCacheEntry* entry = &allocator->cache[i];
+		if(entry->block && entry->is_dirty) {
+			if(!block_write(device, entry->block, &allocator->cache_mem[i*block_size])) return 0;
+			allocator->inode_block_writes += 1;
+			for_each_lt(j, (INODE_MASK + 1)/64) {
+				allocator->inodes_flushed += __builtin_popcountll(entry->dirty_inodes[j]);
+				entry->dirty_inodes[j] = 0;
 			}
-			i += 1;
+			entry->is_dirty = 0;
 		}
-		INodePid next = 0;
-		if(!block_writes(device, block, i*sizeof(INode), &next, sizeof(INodePid))) {
-			block_free(device, block);
-			return 0;
+	}
+	return 1;
+}
+static int inode_cache_get(BlockDevice* device, INodeAllocator* allocator, BlockPid block, bool is_new) {
+	//returns the index of block in the cache, reading it in from the device if it is missing
+	//if is_new is set, block is a freshly allocated inode block and is zeroed instead
+	uint64 hash = cast(uint64, block)*0x9E3779B97F4A7C15ull;
+	int i = hash>>(64 - __builtin_ctz(INODE_CACHE_SIZE));
+	while(allocator->cache[i].block) {
+		if(allocator->cache[i].block == block) return i;
+		i = (i + 1)&(INODE_CACHE_SIZE - 1);
+	}
+	if(allocator->cache_size >= INODE_CACHE_LOAD_MAX) {
+		//the cache is full, write it all back and start over
+		if(!inode_flush_(device, allocator)) return -1;
+		inode_cache_reset(allocator);
+		return inode_cache_get(device, allocator, block, is_new);
+	}
+	byte* mem = &allocator->cache_mem[i*device->block_size];
+	if(is_new) {
+		memzero(mem, device->block_size);
+	} else if(!block_read(device, block, mem)) {
+		return -1;
+	}
+	INodeCacheEntry* entry = &allocator->cache[i];
+	entry->block = block;
+	entry->is_dirty = is_new;
+	memzero(entry->dirty_inodes, sizeof(entry->dirty_inodes));
+	allocator->cache_size += 1;
+	return i;
+}
+
+bool inode_flush(BlockDevice* device, INodeAllocator* allocator) {
+	pthread_mutex_lock(&allocator->mutex);
+	bool ok = inode_flush_(device, allocator);
+	pthread_mutex_unlock(&allocator->mutex);
+	return ok;
+}
+
+static INodeMap* inode_get_map(INodeAllocator* allocator, int i) {
+	return &allocator->maps[i*allocator->map_words];
+}
+static int inode_find_map(INodeAllocator* allocator, BlockPid block) {
+	//binary search over the sorted maps, returns the index block would be inserted at if it is missing
+	int lo = 0;
+	int hi = allocator->maps_size;
+	while(lo < hi) {
+		int mid = (lo + hi)/2;
+		if(inode_get_map(allocator, mid)[0] < block) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+static int inode_add_map(BlockDevice* device, INodeAllocator* allocator) {
+	//formats a new inode block in the inode table cache, so it is written once on the next flush, and gives it a fully free map
+	BlockPid block = block_alloc(device);
+	if(!block) return -1;
+	if(inode_cache_get(device, allocator, block, 1) < 0) {
+		block_free(device, block);
+		return -1;
+	}
+	if(allocator->maps_size >= allocator->maps_capacity) {
+		allocator->maps_capacity *= 2;
+		allocator->maps = cast(INodeMap*, realloc(allocator->maps, allocator->maps_capacity*allocator->map_words*sizeof(INodeMap)));
+	}
+	int i = inode_find_map(allocator, block);
+	INodeMap* map = inode_get_map(allocator, i);
+	memmove(map + allocator->map_words, map, (allocator->maps_size - i)*allocator->map_words*sizeof(INodeMap));
+	memzero(map, allocator->map_words*sizeof(INodeMap));
+	allocator->maps_size += 1;
+	map[0] = block;
+	for_each_lt(j, allocator->inodes_per_block) {
+		map[1 + j/64] |= ((uint64)1)<<(j%64);
+	}
+	return i;
+}
+
+static INodePid inode_alloc(BlockDevice* device, INodeAllocator* allocator) {
+	int words = allocator->map_words;
+	int i = allocator->first_free_map;
+	while(1) {
+		if(i >= allocator->maps_size) {
+			i = inode_add_map(device, allocator);
+			if(i < 0) return 0;
+		}
+		INodeMap* map = inode_get_map(allocator, i);
+		for_each_in_range(j, 1, words - 1) {
+			if(map[j]) {
+				int bit = __builtin_ctzll(map[j]);
+				map[j] &= ~(((uint64)1)<<bit);
+				allocator->first_free_map = i;
+				allocator->is_dirty = 1;
+				return (map[0]<<INODE_SHIFT)|((j - 1)*64 + bit);
+			}
 		}
-		ret_inode = base_pid;
-		allocator->next_inode = base_pid|1;
+		i += 1;
 	}
-	return ret_inode;
 }
 static bool     inode_free (BlockDevice* device, INodeAllocator* allocator, INodePid pid) {
 	uint inode_i = pid&INODE_MASK;
 	BlockPid block = pid>>INODE_SHIFT;
-	INodePid next = allocator->next_inode;
-	if(block_writes(device, block, inode_i*sizeof(INode), &next, sizeof(INodePid))) {
-		allocator->next_inode = pid;
-		return 1;
-	} else {
-		return 0;
+	int i = inode_find_map(allocator, block);
+	if(i >= allocator->maps_size) {ASSERT(0); return 0;}
+	INodeMap* map = inode_get_map(allocator, i);
+	if(map[0] != block) {ASSERT(0); return 0;}
+	map[1 + inode_i/64] |= ((uint64)1)<<(inode_i%64);
+	if(i < allocator->first_free_map) {
+		allocator->first_free_map = i;
 	}
+	allocator->is_dirty = 1;
+	return 1;
 }
 
 void inode_initfs(INodeAllocator* allocator, int block_size) {
 	ASSERT(block_size >= INODE_BLOCK_SIZE_MIN);
 	ASSERT(block_size <= INODE_BLOCK_SIZE_MAX);
-	allocator->next_inode = 0;
 	allocator->inodes_per_block = block_size/sizeof(INode);
+	memzero(&allocator->map_inode, sizeof(INode));
+	allocator->map_inode.status = INODE_BUFFER;
+	allocator->map_inode.flags = INODE_IS_INLINE;
+	allocator->refs_inode = allocator->map_inode;
+	allocator->map_words = INODE_MAP_WORDS(allocator->inodes_per_block);
+	allocator->maps_size = 0;
+	allocator->maps_capacity = 32;
+	allocator->maps = cast(INodeMap*, malloc(allocator->maps_capacity*allocator->map_words*sizeof(INodeMap)));
+	allocator->first_free_map = 0;
+	allocator->is_dirty = 1;
+	allocator->cache = cast(INodeCacheEntry*, malloc(INODE_CACHE_SIZE*sizeof(INodeCacheEntry)));
+	allocator->cache_mem = cast(byte*, malloc(INODE_CACHE_SIZE*block_size));
+	allocator->inodes_flushed = 0;
+	allocator->inode_block_writes = 0;
+	pthread_mutex_init(&allocator->mutex, 0);
+	inode_cache_reset(allocator);
 }
 bool inode_mountfs(BlockDevice* device, INodeAllocator* allocator) {
-	return block_reads_m(device, 0, sizeof(device->persistent_data), allocator, sizeof(INodeAllocator));
+	if(!block_reads_m(device, 0, sizeof(device->persistent_data), &allocator->persistent_data, sizeof(allocator->persistent_data))) return 0;
+	allocator->map_words = INODE_MAP_WORDS(allocator->inodes_per_block);
+	int map_size = allocator->map_words*sizeof(INodeMap);
+	allocator->maps_size = allocator->map_inode.mem_size/map_size;
+	allocator->maps_capacity = allocator->maps_size + 32;
+	allocator->maps = cast(INodeMap*, malloc(allocator->maps_capacity*map_size));
+	allocator->first_free_map = 0;
+	allocator->is_dirty = 0;
+	allocator->cache = cast(INodeCacheEntry*, malloc(INODE_CACHE_SIZE*sizeof(INodeCacheEntry)));
+	allocator->cache_mem = cast(byte*, malloc(INODE_CACHE_SIZE*device->block_size));
+	allocator->inodes_flushed = 0;
+	allocator->inode_block_writes = 0;
+	pthread_mutex_init(&allocator->mutex, 0);
+	inode_cache_reset(allocator);
+	if(allocator->maps_size > 0) {
+		if(!inode_read(device, &allocator->map_inode, 0, allocator->maps, allocator->maps_size*map_size)) return 0;
+	}
+	int64 refs_size = allocator->refs_inode.mem_size/sizeof(BlockRef);
+	if(refs_size > 0) {
+		BlockRef* refs = cast(BlockRef*, malloc(refs_size*sizeof(BlockRef)));
+		bool ok = inode_read(device, &allocator->refs_inode, 0, refs, refs_size*sizeof(BlockRef));
+		if(ok) {
+			for_each_lt(i, refs_size) {
+				block_set_refs(device, refs[i].pid, refs[i].refs);
+			}
+		}
+		free(refs);
+		if(!ok) return 0;
+	}
+	device->is_refs_dirty = 0;
+	return 1;
+}
+bool inode_savefs(BlockDevice* device, INodeAllocator* allocator) {
+	if(!inode_flush(device, allocator)) return 0;
+	if(allocator->is_dirty) {
+		uint64 maps_mem_size = allocator->maps_size*allocator->map_words*sizeof(INodeMap);
+		if(maps_mem_size > 0) {
+			if(!inode_write(device, &allocator->map_inode, 0, allocator->maps, maps_mem_size)) return 0;
+		}
+		allocator->is_dirty = 0;
+	}
+	if(device->is_refs_dirty) {
+		//only the used entries of the device's table are saved
+		uint64 refs_mem_size = device->refs_size*sizeof(BlockRef);
+		BlockRef* refs = cast(BlockRef*, malloc(refs_mem_size + sizeof(BlockRef)));
+		int64 refs_size = 0;
+		for_each_lt(i, device->refs_capacity) {
+			if(device->refs[i].pid) {
+				refs[refs_size] = device->refs[i];
+				refs_size += 1;
+			}
+		}
+		bool ok = inode_set_size(device, &allocator->refs_inode, refs_mem_size);
+		if(ok && refs_mem_size > 0) {
+			ok = inode_write(device, &allocator->refs_inode, 0, refs, refs_mem_size);
+		}
+		free(refs);
+		if(!ok) return 0;
+		device->is_refs_dirty = 0;
+	}
+	return block_writes_m(device, 0, sizeof(device->persistent_data), &allocator->persistent_data, sizeof(allocator->persistent_data));
 }
 bool inode_unmountfs(BlockDevice* device, INodeAllocator* allocator) {
-	return block_writes_m(device, 0, sizeof(device->persistent_data), allocator, sizeof(INodeAllocator));
+	bool ok = inode_savefs(device, allocator);
+	free(allocator->maps);
+	free(allocator->cache);
+	free(allocator->cache_mem);
+	allocator->maps = 0;
+	allocator->cache = 0;
+	allocator->cache_mem = 0;
+	pthread_mutex_destroy(&allocator->mutex);
+	return ok;
 }
 
 
@@ -129,53 +382,51 @@ static int inode_get_required_level(int64 mem_size, int block_size) {
 	return level;
 }
 
-bool inode_save(BlockDevice* device, const INode* inode) {
-	return block_writes(device, inode->pid>>INODE_SHIFT, (inode->pid&INODE_MASK)*sizeof(INode), inode, sizeof(INode));
+static bool inode_save_(BlockDevice* device, INodeAllocator* allocator, const INode* inode) {
+	uint inode_i = inode->pid&INODE_MASK;
+	int i = inode_cache_get(device, allocator, inode->pid>>INODE_SHIFT, 0);
+	if(i < 0) return 0;
+	INodeCacheEntry* entry = &allocator->cache[i];
+	memcpy(&allocator->cache_mem[i*device->block_size + inode_i*sizeof(INode)], inode, sizeof(INode));
+	entry->is_dirty = 1;
+	entry->dirty_inodes[inode_i/64] |= ((uint64)1)<<(inode_i%64);
+	return 1;
+}
+bool inode_save(BlockDevice* device, INodeAllocator* allocator, const INode* inode) {
+	pthread_mutex_lock(&allocator->mutex);
+	bool ok = inode_save_(device, allocator, inode);
+	pthread_mutex_unlock(&allocator->mutex);
+	return ok;
 }
-bool inode_restore(BlockDevice* device, INodePid pid, INode* inode) {
-	return block_reads(device, pid>>INODE_SHIFT, (pid&INODE_MASK)*sizeof(INode), inode, sizeof(INode));
+bool inode_restore(BlockDevice* device, INodeAllocator* allocator, INodePid pid, INode* inode) {
+	pthread_mutex_lock(&allocator->mutex);
+	int i = inode_cache_get(device, allocator, pid>>INODE_SHIFT, 0);
+	if(i >= 0) memcpy(inode, &allocator->cache_mem[i*device->block_size + (pid&INODE_MASK)*sizeof(INode)], sizeof(INode));
+	pthread_mutex_unlock(&allocator->mutex);
+	return i >= 0;
 }
 
 bool inode_create(BlockDevice* device, INodeAllocator* allocator, uint64 mem_size, INode* inode) {
+	pthread_mutex_lock(&allocator->mutex);
 	INodePid pid = inode_alloc(device, allocator);
-	if(!pid) return 0;
+	if(!pid) {
+		pthread_mutex_unlock(&allocator->mutex);
+		return 0;
+	}
 	inode->pid = pid;
 	inode->level = inode_get_required_level(mem_size, device->block_size);
 	inode->status = INODE_BUFFER;
+	inode->flags = (mem_size <= INODE_INLINE_SIZE) ? INODE_IS_INLINE : 0;
 	inode->mem_size = mem_size;
 	for_each_lt(i, BLOCKS_PER_INODE) {
 		inode->blocks[i] = 0;
 	}
-	inode_save(device, inode);
-	return 1;
-}
-
-static bool free_all(BlockDevice* device, BlockPid pid, int level) {
-	if(pid) {
-		if(level > 0) {
-			for_each_lt(i, device->block_size/sizeof(BlockPid)) {
-				BlockPid next_pid;
-				if(!block_reads(device, pid, i*sizeof(BlockPid), &next_pid, sizeof(BlockPid))) return 0;
-				if(!free_all(device, next_pid, level - 1)) return 0;
-			}
-		}
-		if(!block_free(device, pid)) return 0;
-	}
-	return 1;
-}
-bool inode_destroy(BlockDevice* device, INodeAllocator* allocator, INode* inode) {
-	for_each_lt(i, BLOCKS_PER_INODE) {
-		if(!free_all(device, inode->blocks[i], inode->level)) return 0;
-		inode->blocks[i] = 0;
-	}
-	inode->level = 0;
-	inode->status = INODE_INVALID;
-	inode->mem_size = 0;
-	inode_save(device, inode);
-	if(!inode_free(device, allocator, inode->pid)) return 0;
-	return 1;
+	bool ok = inode_save_(device, allocator, inode);
+	pthread_mutex_unlock(&allocator->mutex);
+	return ok;
 }
 
+static const byte inode_zero_mem[INODE_BLOCK_SIZE_MAX] = {0};
 
 static int64 powi(int64 base, int p) {
 	int64 ret = 1;
@@ -185,164 +436,578 @@ static int64 powi(int64 base, int p) {
 	return ret;
 }
 
-static BlockPid alloc_block_pids(BlockDevice* device, BlockPid above_pid, int pid_index) {
-	BlockPid ret = block_alloc(device);
-	if(!ret) return 0;
-	void* empty_mem = alloca(device->block_size);
-	memzero(empty_mem, device->block_size);
-	if(!block_write(device, ret, empty_mem)) return 0;
-	if(above_pid) {
-		if(!block_writes(device, above_pid, pid_index*sizeof(BlockPid), &ret, sizeof(BlockPid))) return 0;
+//the block tree iterator walks over the data blocks of an inode in order, one run of blocks at a time
+//every pointer block on the path to the current data block is held in a buffer on a stack,
+//so each one is read once and written once, when the iterator moves out of it, however many of its pids are used
+enum INodeIterMode {
+	INODE_ITER_READ,
+	INODE_ITER_WRITE,//missing blocks are allocated, and shared or unwritten blocks are made ready to be written to
+	INODE_ITER_FREE,//every block from block_begin on is freed, the blocks from block_begin to block_end must all be visited
+};
+typedef struct INodeIterLevel {
+	BlockPid pid;//0 if no pointer block is held at this level
+	int64 base;//the first data block under the pointer block
+	bool is_dirty;
+	BlockPid* pids;
+} INodeIterLevel;
+typedef struct INodeIter {
+	INode* inode;
+	enum INodeIterMode mode;
+	int level;
+	int block_base;
+	int64 block_begin;
+	int64 block_offset;//the first data block of the next run
+	int64 block_end;
+	int64 full_begin;//in write mode, the data blocks in [full_begin, full_end) are about to be overwritten entirely
+	int64 full_end;
+	INodeIterLevel stack[INODE_LEVEL_MAX];//stack[l - 1] holds the pointer block of level l, the ones of level 1 hold data pids
+	byte* stack_mem;
+} INodeIter;
+
+static void iter_begin(BlockDevice* device, INode* inode, INodeIter* it, enum INodeIterMode mode, int64 block_begin, int64 block_end) {
+	ASSERT(!(inode->flags & INODE_IS_INLINE));
+	ASSERT(inode->level <= INODE_LEVEL_MAX);
+	int block_size = device->block_size;
+	it->inode = inode;
+	it->mode = mode;
+	it->level = inode->level;
+	it->block_base = block_size/sizeof(BlockPid);
+	it->block_begin = block_begin;
+	it->block_offset = block_begin;
+	it->block_end = block_end;
+	it->full_begin = 0;
+	it->full_end = 0;
+	it->stack_mem = (it->level > 0) ? cast(byte*, malloc(it->level*block_size)) : 0;
+	for_each_lt(i, it->level) {
+		it->stack[i].pid = 0;
+		it->stack[i].pids = cast(BlockPid*, &it->stack_mem[i*block_size]);
 	}
-	return ret;
 }
-static bool get_block_pid(BlockDevice* device, BlockPid above_pid, int pid_index, bool alloc_if_missing, BlockPid* ret) {
-	BlockPid ret0 = 0;
-	if(above_pid) {
-		if(!block_reads(device, above_pid, pid_index*sizeof(BlockPid), &ret0, sizeof(BlockPid))) return 0;
-		if(alloc_if_missing && !ret0) {
-			ret0 = alloc_block_pids(device, above_pid, pid_index);
-			if(!ret0) return 0;
+static BlockPid* iter_parent_slot(INodeIter* it, int level, int64 base) {
+	//returns the slot holding the pid of the pointer block of the given level whose first data block is base
+	int64 span = powi(it->block_base, level);
+	if(level == it->level) return &it->inode->blocks[base/span];
+	return &it->stack[level].pids[(base/span)%it->block_base];
+}
+static void iter_set_parent(INodeIter* it, int level, int64 base, BlockPid pid) {
+	*iter_parent_slot(it, level, base) = pid;
+	if(level < it->level) {
+		it->stack[level].is_dirty = 1;
+	}
+}
+static bool iter_pop(BlockDevice* device, INodeIter* it, int level) {
+	//lets go of the pointer blocks held at the given level and below
+	for_each_in_range(l, 1, level) {
+		INodeIterLevel* cur = &it->stack[l - 1];
+		if(!cur->pid) continue;
+		if(it->mode == INODE_ITER_FREE && cur->base >= it->block_begin) {
+			//everything below it has been freed by now
+			if(!block_free(device, cur->pid)) return 0;
+			iter_set_parent(it, l, cur->base, 0);
+		} else if(cur->is_dirty) {
+			if(!block_write(device, cur->pid, cur->pids)) return 0;
 		}
+		cur->pid = 0;
 	}
-	*ret = ret0;
 	return 1;
 }
-
-enum IncrementPathMode {
-	INC_PATH_WRITE,
-	INC_PATH_READ,
-	INC_PATH_FREE,
-};
-static int64 increment_block_path(BlockDevice* device, INode* inode, int* block_path, BlockPid* block_path_pids, enum IncrementPathMode mode, BlockPid* ret, int64 blocks_stepped_max) {
-	//NOTE: DO NOT CALL OUTSIDE OF THE READ, WRITE AND FREE FUNCTIONS
-	//this function is basically a fancy macro for the path increment algorithm
-	int level = inode->level;
-	int block_size = device->block_size;
-	int block_base = block_size/sizeof(BlockPid);
-	//get next block's pid from the path, we do this by performing an increment on the path's numeric value
-	int64 blocks_stepped = 1;
-	if(blocks_stepped > blocks_stepped_max) {
-		*ret = 0;
-		return blocks_stepped_max;
+static bool iter_end(BlockDevice* device, INodeIter* it) {
+	bool ok = iter_pop(device, it, it->level);
+	free(it->stack_mem);
+	it->stack_mem = 0;
+	return ok;
+}
+static bool iter_get_leaf(BlockDevice* device, INodeIter* it, int64 block, BlockPid** ret_leaf, int64* ret_hole_end) {
+	//sets ret_leaf to the array of pids holding the pid of the given data block, loading the pointer blocks on the path to it
+	//if the path is missing a pointer block, ret_leaf is set to 0 and ret_hole_end to the end of the data blocks it would hold
+	*ret_leaf = 0;
+	if(it->level == 0) {
+		*ret_leaf = it->inode->blocks;
+		return 1;
 	}
-	while(1) {
-		BlockPid bottom_most_unchanged_pid;
-		int i = 0;
-		while(1) {
-			//perform addition with overflow on the block path; this decreases the number of reads from disk we have to do from linear to logarithmic in the inode level per block
-			if(i >= level) {
-				if(block_path[i] + 1 >= BLOCKS_PER_INODE) {
-					//we've reached the absolute largest path possible
-					for_each_in_range_bw(j, 0, i) {
-						if(mode == INC_PATH_FREE) {
-							if(!block_free(device, block_path_pids[j])) return 0;
-						}
-						block_path_pids[j] = 0;
-					}
-					*ret = 0;
-					return blocks_stepped_max;
-				} else {
-					block_path[level] += 1;
-					bottom_most_unchanged_pid = inode->blocks[block_path[level]];
-					if(mode == INC_PATH_WRITE && !bottom_most_unchanged_pid) {
-						bottom_most_unchanged_pid = alloc_block_pids(device, 0, 0);
-						inode->blocks[block_path[level]] = bottom_most_unchanged_pid;
-					}
-					if(mode == INC_PATH_FREE && block_path_pids[level]) {
-						if(!block_free(device, block_path_pids[level])) return 0;
-					}
-					block_path_pids[level] = bottom_most_unchanged_pid;
-					i = level - 1;
-					//increment can't go further
-					break;
+	int block_size = it->block_base*sizeof(BlockPid);
+	int64 span = powi(it->block_base, it->level);
+	if(block/span >= BLOCKS_PER_INODE) {ASSERT(0); return 0;}
+	for_each_in_range_bw(l, 1, it->level) {
+		INodeIterLevel* cur = &it->stack[l - 1];
+		int64 base = block - block%span;
+		if(!cur->pid || cur->base != base) {
+			if(!iter_pop(device, it, l)) return 0;
+			BlockPid pid = *iter_parent_slot(it, l, base);
+			bool is_shared = pid && block_get_refs(device, pid) > 1;
+			if(is_shared && it->mode == INODE_ITER_FREE && base >= it->block_begin) {
+				//everything below the pointer block is left to its other owners
+				if(!block_free(device, pid)) return 0;
+				iter_set_parent(it, l, base, 0);
+				pid = 0;
+				is_shared = 0;
+			}
+			if(!pid) {
+				if(it->mode != INODE_ITER_WRITE) {
+					*ret_hole_end = base + span;
+					return 1;
 				}
-			} else if(block_path[i] + 1 >= block_base) {
-				//path overflow
-				block_path[i] = 0;
-				i += 1;
+				pid = block_alloc(device);
+				if(!pid) return 0;
+				memzero(cur->pids, block_size);
+				cur->is_dirty = 1;
+				iter_set_parent(it, l, base, pid);
 			} else {
-				bottom_most_unchanged_pid = block_path_pids[i + 1];
-				block_path[i] += 1;
-				if(mode == INC_PATH_WRITE || bottom_most_unchanged_pid) {
-					//increment is done
-					break;
-				} else {
-					//skip the empty blocks by forcing an overflow and continuing increment
-					blocks_stepped += (block_base - block_path[i])*powi(block_base, i);
-					if(blocks_stepped > blocks_stepped_max) {
-						*ret = 0;
-						return blocks_stepped_max;
+				if(!block_read(device, pid, cur->pids)) return 0;
+				cur->is_dirty = 0;
+				if(is_shared && it->mode != INODE_ITER_READ) {
+					//copy on write, the copy is another reference to every block below it
+					for_each_lt(i, it->block_base) {
+						BlockPid child_pid = cur->pids[i] & ~INODE_UNWRITTEN;
+						if(child_pid && !block_share(device, child_pid)) return 0;
 					}
-					block_path[i] = 0;
-					i += 1;
+					if(!block_free(device, pid)) return 0;
+					pid = block_alloc(device);
+					if(!pid) return 0;
+					cur->is_dirty = 1;
+					iter_set_parent(it, l, base, pid);
 				}
 			}
+			cur->pid = pid;
+			cur->base = base;
 		}
-		//walk down the path again to the next block pid
-		for_each_in_range_bw(j, 0, i) {
-			if(!get_block_pid(device, bottom_most_unchanged_pid, block_path[j], mode == INC_PATH_WRITE, &bottom_most_unchanged_pid)) return 0;
-			if(mode == INC_PATH_FREE && block_path_pids[j]) {
-				//Kind of hacky, but this was the easiest way to implement freeing, and this is a private helper function anyways
-				if(!block_free(device, block_path_pids[j])) return 0;
+		span /= it->block_base;
+	}
+	*ret_leaf = it->stack[0].pids;
+	return 1;
+}
+static bool iter_next(BlockDevice* device, INodeIter* it, BlockPid* ret_pid, int64* ret_size, bool* ret_is_new) {
+	//moves the iterator over the next run of data blocks, which is either missing blocks, with a pid of 0,
+	//or blocks that are consecutive on the device, ret_pid is then the pid of the first one, including INODE_UNWRITTEN
+	//in write mode no block is missing, and ret_is_new is set if the contents of the blocks are undefined,
+	//so any of them that isn't overwritten entirely must be written with zeros around the data
+	int64 block = it->block_offset;
+	*ret_pid = 0;
+	*ret_size = 0;
+	*ret_is_new = 0;
+	BlockPid* leaf;
+	int64 hole_end;
+	if(!iter_get_leaf(device, it, block, &leaf, &hole_end)) return 0;
+	if(!leaf) {
+		//skip over everything the missing pointer block would have held
+		if(hole_end > it->block_end) hole_end = it->block_end;
+		*ret_size = hole_end - block;
+		it->block_offset = hole_end;
+		return 1;
+	}
+	int64 leaf_base = (it->level > 0) ? it->stack[0].base : 0;
+	int64 leaf_size = (it->level > 0) ? it->block_base : BLOCKS_PER_INODE;
+	int64 i = block - leaf_base;
+	int64 end = it->block_end - leaf_base;
+	if(end > leaf_size) end = leaf_size;
+	BlockPid pid = leaf[i];
+	int64 size = 1;
+	bool is_changed = 0;
+	if(it->mode == INODE_ITER_WRITE) {
+		BlockPid data_pid = pid & ~INODE_UNWRITTEN;
+		if(!pid) {
+			//the missing blocks are given a run of consecutive blocks, which is never zeroed
+			while(i + size < end && !leaf[i + size]) {
+				size += 1;
 			}
-			block_path_pids[j] = bottom_most_unchanged_pid;
-		}
-		if(mode == INC_PATH_WRITE || block_path_pids[0]) {
-			*ret = block_path_pids[0];
-			return blocks_stepped;
+			pid = block_alloc_run(device, size, &size);
+			if(!pid) return 0;
+			for_each_lt(j, size) {
+				leaf[i + j] = pid + j;
+			}
+			*ret_is_new = 1;
+			is_changed = 1;
+		} else if(block_get_refs(device, data_pid) > 1) {
+			//copy on write, a block that is about to be overwritten entirely doesn't need its contents copied
+			pid = block_alloc(device);
+			if(!pid) return 0;
+			if((leaf[i] & INODE_UNWRITTEN) || (block >= it->full_begin && block < it->full_end)) {
+				*ret_is_new = 1;
+			} else {
+				void* data_mem = alloca(device->block_size);
+				if(!block_read(device, data_pid, data_mem) || !block_write(device, pid, data_mem)) return 0;
+			}
+			if(!block_free(device, data_pid)) return 0;
+			leaf[i] = pid;
+			is_changed = 1;
 		} else {
-			blocks_stepped += 1;
-			if(blocks_stepped > blocks_stepped_max) {
-				*ret = 0;
-				return blocks_stepped_max;
+			//a run of blocks owned by this inode alone, either all written or all unwritten
+			while(i + size < end && leaf[i + size] == pid + size && block_get_refs(device, data_pid + size) == 1) {
+				size += 1;
+			}
+			if(pid & INODE_UNWRITTEN) {
+				pid = data_pid;
+				for_each_lt(j, size) {
+					leaf[i + j] = pid + j;
+				}
+				*ret_is_new = 1;
+				is_changed = 1;
 			}
 		}
+	} else {
+		while(i + size < end && leaf[i + size] == (pid ? pid + size : 0)) {
+			size += 1;
+		}
+		if(it->mode == INODE_ITER_FREE && pid) {
+			for_each_lt(j, size) {
+				if(!block_free(device, (pid + j) & ~INODE_UNWRITTEN)) return 0;
+				leaf[i + j] = 0;
+			}
+			is_changed = 1;
+		}
+	}
+	if(is_changed && it->level > 0) {
+		it->stack[0].is_dirty = 1;
+	}
+	if(pid && !*ret_is_new && it->mode != INODE_ITER_FREE) {
+		//the run continues into the following pointer blocks for as long as the pids stay consecutive
+		int64 run_end = block + size;
+		while(run_end == leaf_base + leaf_size && run_end < it->block_end) {
+			if(!iter_get_leaf(device, it, run_end, &leaf, &hole_end)) return 0;
+			if(!leaf) break;
+			leaf_base = it->stack[0].base;
+			while(run_end < it->block_end && run_end < leaf_base + leaf_size && leaf[run_end - leaf_base] == pid + (run_end - block)) {
+				if(it->mode == INODE_ITER_WRITE && block_get_refs(device, pid + (run_end - block)) > 1) break;
+				run_end += 1;
+			}
+		}
+		size = run_end - block;
+	}
+	*ret_pid = pid;
+	*ret_size = size;
+	it->block_offset = block + size;
+	return 1;
+}
+
+static bool inode_free_blocks(BlockDevice* device, INode* inode, int64 block_offset) {
+	//frees every block of the inode holding data from block_offset on
+	INodeIter it;
+	iter_begin(device, inode, &it, INODE_ITER_FREE, block_offset, BLOCKS_PER_INODE*powi(device->block_size/sizeof(BlockPid), inode->level));
+	bool ok = 1;
+	while(ok && it.block_offset < it.block_end) {
+		BlockPid pid;
+		int64 size;
+		bool is_new;
+		ok = iter_next(device, &it, &pid, &size, &is_new);
+	}
+	return iter_end(device, &it) && ok;
+}
+bool inode_destroy(BlockDevice* device, INodeAllocator* allocator, INode* inode) {
+	//inline data is not a list of pids, so there is nothing to free
+	if(!(inode->flags & INODE_IS_INLINE)) {
+		if(!inode_free_blocks(device, inode, 0)) return 0;
 	}
+	for_each_lt(i, BLOCKS_PER_INODE) {
+		inode->blocks[i] = 0;
+	}
+	inode->level = 0;
+	inode->flags = 0;
+	inode->status = INODE_INVALID;
+	inode->mem_size = 0;
+	pthread_mutex_lock(&allocator->mutex);
+	bool ok = inode_save_(device, allocator, inode) && inode_free(device, allocator, inode->pid);
+	pthread_mutex_unlock(&allocator->mutex);
+	return ok;
 }
-static bool get_block_path(BlockDevice* device, INode* inode, int* block_path, BlockPid* block_path_pids, int64 block_offset, enum IncrementPathMode mode) {
-	//helper function to go along with increment_block_path
-	//initializes the block_path and block_path_pids arrays
+
+static bool get_block_path(BlockDevice* device, INode* inode, int* block_path, BlockPid* block_path_pids, int64 block_offset) {
+	//walks down to the given block of data, setting block_path to the index taken at every level and block_path_pids to the pid found there
 	int level = inode->level;
-	int block_size = device->block_size;
-	int block_base = block_size/sizeof(BlockPid);
-	//find the initial block, and it's path in the inode
+	int block_base = device->block_size/sizeof(BlockPid);
 	for_each_lt(i, level) {
 		block_path[i] = block_offset%block_base;
 		block_offset /= block_base;
 	}
 	ASSERT(block_offset < BLOCKS_PER_INODE);
 	BlockPid top_pid = inode->blocks[block_offset];
-	if(mode == INC_PATH_WRITE && !top_pid) {
-		top_pid = alloc_block_pids(device, 0, 0);
-		inode->blocks[block_offset] = top_pid;
-	}
 	block_path[level] = block_offset;//index in block struct array
 	block_path_pids[level] = top_pid;//value at that index
 	for_each_lt_bw(i, level) {
-		if(!get_block_pid(device, top_pid, block_path[i], mode == INC_PATH_WRITE, &top_pid)) return 0;
+		if(top_pid) {
+			if(!block_reads(device, top_pid, block_path[i]*sizeof(BlockPid), &top_pid, sizeof(BlockPid))) return 0;
+		}
 		block_path_pids[i] = top_pid;
 	}
 	return 1;
 }
 
+static bool inode_uninline(BlockDevice* device, INode* inode) {
+	//moves the inline data of the inode out into its first data block, turning it back into a regular level 0 inode
+	ASSERT(inode->flags & INODE_IS_INLINE);
+	BlockPid data_pid = 0;
+	if(inode->mem_size > 0) {
+		data_pid = block_alloc(device);
+		if(!data_pid) return 0;
+		//the block will always have enough space bc of INODE_BLOCK_SIZE_MIN
+		void* data_mem = alloca(device->block_size);
+		memzero(data_mem, device->block_size);
+		memcpy(data_mem, &inode->blocks[0], inode->mem_size);
+		if(!block_write(device, data_pid, data_mem)) {
+			block_free(device, data_pid);
+			return 0;
+		}
+	}
+	for_each_lt(i, BLOCKS_PER_INODE) {
+		inode->blocks[i] = 0;
+	}
+	inode->blocks[0] = data_pid;
+	inode->level = 0;
+	inode->flags &= ~INODE_IS_INLINE;
+	return 1;
+}
+
+bool inode_get_blocks(BlockDevice* device, INode* inode, int64 block_offset, int64 blocks_size, BlockPid* ret_pids) {
+	ASSERT(!(inode->flags & INODE_IS_INLINE));
+	if(blocks_size <= 0) return 1;
+	INodeIter it;
+	iter_begin(device, inode, &it, INODE_ITER_READ, block_offset, block_offset + blocks_size);
+	bool ok = 1;
+	while(ok && it.block_offset < it.block_end) {
+		BlockPid* cur_pids = &ret_pids[it.block_offset - block_offset];
+		BlockPid pid;
+		int64 size;
+		bool is_new;
+		ok = iter_next(device, &it, &pid, &size, &is_new);
+		for_each_lt(i, size) {
+			cur_pids[i] = pid ? pid + i : 0;
+		}
+	}
+	return iter_end(device, &it) && ok;
+}
+bool inode_set_blocks(BlockDevice* device, INode* inode, int64 block_offset, int64 blocks_size, const BlockPid* pids) {
+	ASSERT(!(inode->flags & INODE_IS_INLINE));
+	if(blocks_size <= 0) return 1;
+	INodeIter it;
+	iter_begin(device, inode, &it, INODE_ITER_WRITE, block_offset, block_offset + blocks_size);
+	bool ok = 1;
+	for(int64 i = 0; ok && i < blocks_size; i += 1) {
+		int64 block = block_offset + i;
+		BlockPid* leaf;
+		int64 hole_end;
+		ok = iter_get_leaf(device, &it, block, &leaf, &hole_end);
+		if(!ok) break;
+		BlockPid* slot = &leaf[(inode->level > 0) ? block - it.stack[0].base : block];
+		//the block being replaced is dropped
+		BlockPid old_pid = *slot & ~INODE_UNWRITTEN;
+		if(old_pid && old_pid != (pids[i] & ~INODE_UNWRITTEN)) {
+			ok = block_free(device, old_pid);
+		}
+		*slot = pids[i];
+		if(pids[i] & INODE_UNWRITTEN) {
+			inode->flags |= INODE_HAS_UNWRITTEN;
+		}
+		if(inode->level > 0) {
+			it.stack[0].is_dirty = 1;
+		}
+	}
+	return iter_end(device, &it) && ok;
+}
+bool inode_cursor_seek(BlockDevice* device, INode* inode, INodeCursor* cursor, int64 block_offset) {
+	ASSERT(!(inode->flags & INODE_IS_INLINE));
+	ASSERT(inode->level <= INODE_LEVEL_MAX);
+	cursor->level = inode->level;
+	cursor->block_offset = block_offset;
+	return get_block_path(device, inode, cursor->block_path, cursor->block_path_pids, block_offset);
+}
+bool inode_cursor_next(BlockDevice* device, INode* inode, INodeCursor* cursor) {
+	int block_base = device->block_size/sizeof(BlockPid);
+	int level = cursor->level;
+	BlockPid above_pid = (level > 0) ? cursor->block_path_pids[1] : 0;
+	if(level != inode->level || (level > 0 && (!above_pid || cursor->block_path[0] + 1 >= block_base))) {
+		//the next block is not held by the same pointer block, so we walk down to it again
+		return inode_cursor_seek(device, inode, cursor, cursor->block_offset + 1);
+	}
+	cursor->block_offset += 1;
+	cursor->block_path[0] += 1;
+	if(level == 0) {
+		if(cursor->block_path[0] >= BLOCKS_PER_INODE) {ASSERT(0); return 0;}
+		cursor->block_path_pids[0] = inode->blocks[cursor->block_path[0]];
+		return 1;
+	}
+	return block_reads(device, above_pid, cursor->block_path[0]*sizeof(BlockPid), &cursor->block_path_pids[0], sizeof(BlockPid));
+}
+bool inode_cursor_set_pid(BlockDevice* device, INode* inode, INodeCursor* cursor, BlockPid pid) {
+	int level = cursor->level;
+	if(device->refs_size || level != inode->level || (level > 0 && !cursor->block_path_pids[1])) {
+		//the pointer blocks along the path may be shared or missing, or the path is stale
+		if(!inode_set_blocks(device, inode, cursor->block_offset, 1, &pid)) return 0;
+		return inode_cursor_seek(device, inode, cursor, cursor->block_offset);
+	}
+	if(level == 0) {
+		inode->blocks[cursor->block_path[0]] = pid;
+	} else {
+		if(!block_writes(device, cursor->block_path_pids[1], cursor->block_path[0]*sizeof(BlockPid), &pid, sizeof(BlockPid))) return 0;
+	}
+	cursor->block_path_pids[0] = pid;
+	return 1;
+}
+
+static bool inode_write_part(BlockDevice* device, BlockPid pid, bool is_new, int offset, const void* mem, int mem_size) {
+	if(!is_new) return block_writes(device, pid, offset, mem, mem_size);
+	//the rest of the block is undefined, so the whole block is written with zeros around the data
+	int block_size = device->block_size;
+	byte* block_mem = cast(byte*, alloca(block_size));
+	memzero(block_mem, block_size);
+	memcpy(&block_mem[offset], mem, mem_size);
+	return block_write(device, pid, block_mem);
+}
+static bool inode_transfer(BlockDevice* device, INode* inode, uint64 mem_offset, byte* mem, uint64 mem_size, bool is_write) {
+	//moves data between mem and the inode a run of blocks at a time, the full blocks of a run are moved with a single I/O
+	int block_size = device->block_size;
+	uint64 mem_end = mem_offset + mem_size;
+	INodeIter it;
+	iter_begin(device, inode, &it, is_write ? INODE_ITER_WRITE : INODE_ITER_READ, mem_offset/block_size, (mem_end + block_size - 1)/block_size);
+	it.full_begin = (mem_offset + block_size - 1)/block_size;
+	it.full_end = mem_end/block_size;
+	bool ok = 1;
+	while(ok && it.block_offset < it.block_end) {
+		int64 run_begin = it.block_offset;
+		BlockPid pid;
+		int64 size;
+		bool is_new;
+		ok = iter_next(device, &it, &pid, &size, &is_new);
+		if(!ok) break;
+		uint64 cur_offset = run_begin*block_size;
+		if(cur_offset < mem_offset) cur_offset = mem_offset;
+		uint64 cur_end = (run_begin + size)*block_size;
+		if(cur_end > mem_end) cur_end = mem_end;
+		byte* cur_mem = mem + (cur_offset - mem_offset);
+		if(!pid || (pid & INODE_UNWRITTEN)) {
+			//missing and unwritten blocks read as zeros
+			ASSERT(!is_write);
+			memzero(cur_mem, cur_end - cur_offset);
+			continue;
+		}
+		while(ok && cur_offset < cur_end) {
+			BlockPid cur_pid = pid + (cur_offset/block_size - run_begin);
+			int internal_offset = cur_offset%block_size;
+			if(internal_offset == 0 && cur_end - cur_offset >= block_size) {
+				int64 blocks_size = (cur_end - cur_offset)/block_size;
+				if(is_write) {
+					ok = block_write_run(device, cur_pid, blocks_size, cur_mem);
+				} else {
+					ok = block_read_run(device, cur_pid, blocks_size, cur_mem);
+				}
+				cur_offset += blocks_size*block_size;
+				cur_mem += blocks_size*block_size;
+			} else {
+				//only the first and last blocks of the transfer can be partial
+				int cur_size = block_size - internal_offset;
+				if(cur_size > cur_end - cur_offset) cur_size = cur_end - cur_offset;
+				if(is_write) {
+					ok = inode_write_part(device, cur_pid, is_new, internal_offset, cur_mem, cur_size);
+				} else {
+					ok = block_reads(device, cur_pid, internal_offset, cur_mem, cur_size);
+				}
+				cur_offset += cur_size;
+				cur_mem += cur_size;
+			}
+		}
+	}
+	return iter_end(device, &it) && ok;
+}
+static bool inode_transfer_parallel(BlockDevice* device, INode* inode, uint64 mem_offset, byte* mem, uint64 mem_size, bool is_write) {
+	//resolves the whole range first, then hands the full blocks to the device's I/O pool all at once
+	int block_size = device->block_size;
+	int64 block_offset = mem_offset/block_size;
+	int64 blocks_size = (mem_offset + mem_size + block_size - 1)/block_size - block_offset;
+	BlockPid* pids = cast(BlockPid*, malloc(blocks_size*sizeof(BlockPid)));
+	bool head_is_new = 0;
+	bool tail_is_new = 0;
+	INodeIter it;
+	iter_begin(device, inode, &it, is_write ? INODE_ITER_WRITE : INODE_ITER_READ, block_offset, block_offset + blocks_size);
+	it.full_begin = (mem_offset + block_size - 1)/block_size;
+	it.full_end = (mem_offset + mem_size)/block_size;
+	bool ok = 1;
+	while(ok && it.block_offset < it.block_end) {
+		int64 i = it.block_offset - block_offset;
+		BlockPid pid;
+		int64 size;
+		bool is_new;
+		ok = iter_next(device, &it, &pid, &size, &is_new);
+		//unwritten blocks read the same as missing ones
+		if(pid & INODE_UNWRITTEN) pid = 0;
+		for_each_lt(j, size) {
+			pids[i + j] = pid ? pid + j : 0;
+		}
+		if(i == 0) head_is_new = is_new;
+		if(i + size == blocks_size) tail_is_new = is_new;
+	}
+	ok = iter_end(device, &it) && ok;
+	int head_offset = mem_offset%block_size;
+	int tail_size = (mem_offset + mem_size)%block_size;
+	int64 full_begin = 0;
+	int64 full_end = blocks_size;
+	byte* full_mem = mem;
+	//the partial blocks at either end are transferred on their own
+	if(ok && head_offset) {
+		int head_size = block_size - head_offset;
+		if(!pids[0]) {
+			memzero(mem, head_size);
+		} else if(is_write) {
+			ok = inode_write_part(device, pids[0], head_is_new, head_offset, mem, head_size);
+		} else {
+			ok = block_reads(device, pids[0], head_offset, mem, head_size);
+		}
+		full_begin = 1;
+		full_mem += head_size;
+	}
+	if(ok && tail_size && full_end > full_begin) {
+		byte* tail_mem = mem + mem_size - tail_size;
+		BlockPid tail_pid = pids[blocks_size - 1];
+		if(!tail_pid) {
+			memzero(tail_mem, tail_size);
+		} else if(is_write) {
+			ok = inode_write_part(device, tail_pid, tail_is_new, 0, tail_mem, tail_size);
+		} else {
+			ok = block_reads(device, tail_pid, 0, tail_mem, tail_size);
+		}
+		full_end -= 1;
+	}
+	if(ok && full_end > full_begin) {
+		if(is_write) {
+			ok = block_write_list(device, &pids[full_begin], full_end - full_begin, full_mem);
+		} else {
+			ok = block_read_list(device, &pids[full_begin], full_end - full_begin, full_mem);
+		}
+	}
+	free(pids);
+	return ok;
+}
+
 bool inode_set_size(BlockDevice* device, INode* inode, uint64 mem_size) {
 	int block_size = device->block_size;
 	int block_base = block_size/sizeof(BlockPid);
+	if(inode->flags & INODE_IS_INLINE) {
+		if(mem_size <= INODE_INLINE_SIZE) {
+			if(mem_size < inode->mem_size) {
+				//clear the truncated bytes so they read back as zeros if the inode grows again
+				memzero(ptr_add(byte, &inode->blocks[0], mem_size), inode->mem_size - mem_size);
+			}
+			inode->mem_size = mem_size;
+			return 1;
+		}
+		//the data no longer fits in the inode, so we migrate it to a data block and grow normally from there
+		if(!inode_uninline(device, inode)) return 0;
+	}
 	if(mem_size > inode->mem_size) {
 		//find the new level
 		int new_level = inode_get_required_level(mem_size, block_size);
 		if(new_level > inode->level) {
 			//push the inode struct array down to a block array
-			BlockPid bottom_pid = alloc_block_pids(device, 0, 0);
-			if(!bottom_pid) return 0;
 			//the block will always have enough space bc of INODE_BLOCK_SIZE_MIN
-			if(!block_writes(device, bottom_pid, 0, &inode->blocks[0], BLOCKS_PER_INODE*sizeof(BlockPid))) return 0;
+			BlockPid* pids = cast(BlockPid*, alloca(block_size));
+			memzero(pids, block_size);
+			memcpy(pids, &inode->blocks[0], BLOCKS_PER_INODE*sizeof(BlockPid));
+			BlockPid bottom_pid = block_alloc(device);
+			if(!bottom_pid) return 0;
+			if(!block_write(device, bottom_pid, pids)) return 0;
 			for_each_lt(_, new_level - inode->level - 1) {
-				BlockPid cur_pid = alloc_block_pids(device, 0, 0);
-				if(!cur_pid) return 0;
-				if(!block_writes(device, cur_pid, 0, &bottom_pid, sizeof(BlockPid))) return 0;
-				bottom_pid = cur_pid;
+				memzero(pids, block_size);
+				pids[0] = bottom_pid;
+				bottom_pid = block_alloc(device);
+				if(!bottom_pid) return 0;
+				if(!block_write(device, bottom_pid, pids)) return 0;
 			}
 			//finish filling out the enlargened tree
 			inode->blocks[0] = bottom_pid;
@@ -354,68 +1019,21 @@ bool inode_set_size(BlockDevice* device, INode* inode, uint64 mem_size) {
 		//we need to do nothing extra! technically the tree is already big enough for the size
 		inode->mem_size = mem_size;
 	} else if(mem_size < inode->mem_size) {
-		/*Truncate is unimplemented
-		//the file is getting smaller, we need to free everthing no longer in use, but keep the rest
-		int64 data_blocks_to_preserve = (mem_size + block_size - 1)/block_size;
-		int64 data_blocks_to_free = (inode->mem_size + block_size - 1)/block_size - data_blocks_to_preserve;
-		//get the path to the end of the preserved section
-		int* block_path = cast(int*, alloca((inode->level + 1)*sizeof(int)));//big endian
-		BlockPid* block_path_pids = cast(BlockPid*, alloca((inode->level + 1)*sizeof(BlockPid)));
-		if(!get_block_path(device, inode, block_path, block_path_pids, data_blocks_to_preserve, INC_PATH_FREE)) return 0;
-		//find the new root of the shortened tree, and it's new level
-		//we assume that it is 0 until proven otherwise
-		int new_last_root_index = block_path[0];
-		int new_root_block = (inode->level > 0) ? block_path_pids[1] : 0;
-		int new_level = 0;
-		for_each_in_range_bw(i, 0, inode->level) {
-			//find the first non-zero entry in the path, this is the new root
-			if(block_path[i] > 0) {
-				if(block_path[i] >= BLOCKS_PER_INODE) {
-					ASSERT(i < inode->level);
-					i += 1;
-				}
-				new_level = i;
-				new_last_root_index = block_path[i];
-				if(new_level != inode->level) {
-					new_root_block = block_path_pids[i + 1];
-				} else {
-					//there is no new root block, we don't need to overwrite the struct array
-					new_root_block = 0;
-				}
-				break;
-			}
-		}
-		ASSERT(new_last_root_index < BLOCKS_PER_INODE);
-		ASSERT(new_level <= inode->level);
-
-		//free everything after the preserved section
-		BlockPid cur_pid;
-		if(!increment_block_path(device, inode, block_path, block_path_pids, INC_PATH_READ, &cur_pid, 1)) return 0;
-		while(data_blocks_to_free > 0) {
-			//increment_block_path has a mode that frees blocks it increments over
-			//so we increment over all remaining blocks
-			int64 steps = increment_block_path(device, inode, block_path, block_path_pids, INC_PATH_FREE, &cur_pid, data_blocks_to_free);
-			ASSERT(cur_pid < 100000);
-
-			if(!steps) return 0;
-			data_blocks_to_free -= steps;
-		}
-		//free the last set of blocks increment leaves behind
-		for_each_lt(i, inode->level + 1) {
-			if(block_path_pids[i]) {
-				if(!block_free(device, block_path_pids[i])) return 0;
-			}
-		}
-		//truncate tree
-		if(inode->level != new_level) {
-			if(!block_reads(device, new_root_block, 0, &inode->blocks[0], (new_last_root_index + 1)*sizeof(BlockPid))) return 0;
-			for_each_in_range(i, new_last_root_index + 1, BLOCKS_PER_INODE - 1) {
-				inode->blocks[i] = 0;
+		//the file is getting smaller, everything past the new end is freed
+		int64 blocks_size = (mem_size + block_size - 1)/block_size;
+		int internal_offset = mem_size%block_size;
+		if(internal_offset) {
+			//clear the rest of the last block so it reads back as zeros if the inode grows again
+			BlockPid pid;
+			if(!inode_get_blocks(device, inode, blocks_size - 1, 1, &pid)) return 0;
+			if(pid && !(pid & INODE_UNWRITTEN)) {
+				uint64 zero_end = blocks_size*block_size;
+				if(zero_end > inode->mem_size) zero_end = inode->mem_size;
+				if(!inode_transfer(device, inode, mem_size, cast(byte*, inode_zero_mem), zero_end - mem_size, 1)) return 0;
 			}
-			inode->level = new_level;
 		}
-		//bookkeep
-		*/
+		if(!inode_free_blocks(device, inode, blocks_size)) return 0;
+		//the tree keeps its level, it is never required to be as small as possible
 		inode->mem_size = mem_size;
 	}
 	return 1;
@@ -425,99 +1043,69 @@ bool inode_write(BlockDevice* device, INode* inode, uint64 mem_offset, const voi
 	if(mem_offset + mem_size < mem_size) {ASSERT(0); return 0;}//catch overflows
 	else if(mem_offset + mem_size > inode->mem_size) {
 		//catch mem too large
-		inode_set_size(device, inode, mem_offset + mem_size);
+		if(!inode_set_size(device, inode, mem_offset + mem_size)) return 0;
 	} else if(mem_size == 0) {return 0;}
 	if(!mem_size) return 1;
-
-	int block_size = device->block_size;
-	int level = inode->level;
-	int block_base = block_size/sizeof(BlockPid);
-
-	//find the initial block for writing, and it's path in the inode
-	int internal_offset = mem_offset%block_size;
-	int64 block_offset = mem_offset/block_size;
-	int* block_path = cast(int*, alloca((level + 1)*sizeof(int)));
-	BlockPid* block_path_pids = cast(BlockPid*, alloca((level + 1)*sizeof(BlockPid)));
-	if(!get_block_path(device, inode, block_path, block_path_pids, block_offset, INC_PATH_WRITE)) return 0;
-	//write data to disk
-	BlockPid data_pid0 = block_path_pids[0];
-	int write_size0 = block_size - internal_offset;
-	if(mem_size <= write_size0) {
-		if(!block_writes(device, data_pid0, internal_offset, mem, mem_size)) return 0;
-	} else {
-		if(!block_writes(device, data_pid0, internal_offset, mem, write_size0)) return 0;
-		//data is too big for one block
-		const byte* mem_left = ptr_add(const byte, mem, write_size0);
-		int64 mem_left_size = mem_size - write_size0;
-		while(mem_left_size > 0) {
-			BlockPid cur_data_pid;
-			if(!increment_block_path(device, inode, block_path, block_path_pids, INC_PATH_WRITE, &cur_data_pid, (mem_left_size + block_size - 1)/block_size)) return 0;
-			ASSERT(cur_data_pid);
-			if(mem_left_size >= block_size) {
-				if(!block_write(device, cur_data_pid, mem_left)) return 0;
-				mem_left += block_size;
-				mem_left_size -= block_size;
-			} else {
-				if(!block_writes(device, cur_data_pid, 0, mem_left, mem_left_size)) return 0;
-				break;
-			}
-		}
+	if(inode->flags & INODE_IS_INLINE) {
+		memcpy(ptr_add(byte, &inode->blocks[0], mem_offset), mem, mem_size);
+		return 1;
 	}
-	return 1;
+	if(device->io_pool && mem_size >= 2*device->io_split_size) {
+		return inode_transfer_parallel(device, inode, mem_offset, cast(byte*, mem), mem_size, 1);
+	}
+	return inode_transfer(device, inode, mem_offset, cast(byte*, mem), mem_size, 1);
 }
 
 bool inode_read(BlockDevice* device, INode* inode, uint64 mem_offset, void* mem, uint64 mem_size) {
 	if(mem_offset + mem_size < mem_size) {ASSERT(0); return 0;}//catch overflows
 	else if(mem_offset + mem_size > inode->mem_size) {ASSERT(0); return 0;}//catch mem too large
 	if(!mem_size) return 1;
+	if(inode->flags & INODE_IS_INLINE) {
+		memcpy(mem, ptr_add(byte, &inode->blocks[0], mem_offset), mem_size);
+		return 1;
+	}
+	if(device->io_pool && mem_size >= 2*device->io_split_size) {
+		return inode_transfer_parallel(device, inode, mem_offset, cast(byte*, mem), mem_size, 0);
+	}
+	return inode_transfer(device, inode, mem_offset, cast(byte*, mem), mem_size, 0);
+}
 
-	int block_size = device->block_size;
-	int level = inode->level;
-	int block_base = block_size/sizeof(BlockPid);
+bool inode_view(BlockDevice* device, INode* inode, uint64 mem_offset, uint64 mem_size, const void** ret_mem, uint64* ret_size) {
+	*ret_mem = 0;
+	*ret_size = 0;
+	if(mem_offset + mem_size < mem_size) {ASSERT(0); return 0;}//catch overflows
+	else if(mem_offset + mem_size > inode->mem_size) {ASSERT(0); return 0;}//catch mem too large
+	if(!mem_size) return 1;
+	if(inode->flags & INODE_IS_INLINE) {
+		*ret_mem = ptr_add(const byte, &inode->blocks[0], mem_offset);
+		*ret_size = mem_size;
+		return 1;
+	}
 
-	//find the initial block for reading, and it's path in the inode
+	int block_size = device->block_size;
 	int internal_offset = mem_offset%block_size;
-	int64 block_offset = mem_offset/block_size;
-	int* block_path = cast(int*, alloca((level + 1)*sizeof(int)));
-	BlockPid* block_path_pids = cast(BlockPid*, alloca((level + 1)*sizeof(BlockPid)));
-	if(!get_block_path(device, inode, block_path, block_path_pids, block_offset, INC_PATH_READ)) return 0;
-	//write data to disk
-	BlockPid data_pid0 = block_path_pids[0];
-	int read_size0 = block_size - internal_offset;
-	if(mem_size <= read_size0) {
-		if(!block_reads(device, data_pid0, internal_offset, mem, mem_size)) return 0;
+	//the first run of blocks is all that can be viewed at once
+	INodeIter it;
+	iter_begin(device, inode, &it, INODE_ITER_READ, mem_offset/block_size, (mem_offset + mem_size + block_size - 1)/block_size);
+	BlockPid pid;
+	int64 size;
+	bool is_new;
+	bool ok = iter_next(device, &it, &pid, &size, &is_new);
+	if(!iter_end(device, &it) || !ok) return 0;
+	const void* view_mem;
+	uint64 view_size;
+	if(!pid || (pid & INODE_UNWRITTEN)) {
+		//missing and unwritten blocks read as zeros
+		view_mem = &inode_zero_mem[internal_offset];
+		view_size = block_size - internal_offset;
 	} else {
-		if(!block_reads(device, data_pid0, internal_offset, mem, read_size0)) return 0;
-		//data is too big for one block
-		byte* mem_left = ptr_add(byte, mem, read_size0);
-		int64 mem_left_size = mem_size - read_size0;
-		while(mem_left_size > 0) {
-			BlockPid cur_data_pid;
-			int64 steps = increment_block_path(device, inode, block_path, block_path_pids, INC_PATH_READ, &cur_data_pid, (mem_left_size + block_size - 1)/block_size);
-			if(!steps) return 0;
-			//handle if increment skipped blocks, or is returning 0 as the final block
-			if(!cur_data_pid) {
-				ASSERT(mem_left_size <= steps*block_size);
-				memzero(mem, mem_left_size);
-				break;
-			} else if(steps > 1) {
-				int64 skipped_mem = (steps - 1)*block_size;
-				memzero(mem, skipped_mem);
-				mem_left += skipped_mem;
-				mem_left_size -= skipped_mem;
-			}
-			if(mem_left_size >= block_size) {
-				if(!block_read(device, cur_data_pid, mem_left)) return 0;
-				mem_left += block_size;
-				mem_left_size -= block_size;
-			} else {
-				if(mem_left_size > 0) {
-					if(!block_reads(device, cur_data_pid, 0, mem_left, mem_left_size)) return 0;
-				}
-				break;
-			}
-		}
+		//the blocks of a run are consecutive on the device, so they are consecutive in its mapping
+		view_mem = block_view(device, pid, internal_offset);
+		if(!view_mem) return 0;
+		view_size = size*block_size - internal_offset;
 	}
+	*ret_mem = view_mem;
+	*ret_size = (view_size < mem_size) ? view_size : mem_size;
 	return 1;
 }
 
@@ -471,7 +471,7 @@ MAM_ALLOC__DECLR void mam_stack_pop(MamStack* stack) {
 
 
 MAM_ALLOC__DECLR mam_int mam_pool_alloci(MamPool* pool) {
-	MAM_ALLOC_ASSERT(mam_pool_will_overflow(pool), "mam_alloc: failed to reallocate memory for pool");
+	MAM_ALLOC_ASSERT(!mam_pool_will_overflow(pool), "mam_alloc: failed to reallocate memory for pool");
 	mam_int item = pool->first_unused;
 	if(item) {
 		pool->first_unused = *mam_ptr_add(mam_int, pool, item);
@@ -4,6 +4,7 @@
 
 #define FS_IMPLEMENTATION
 #include "fs.h"
+#include <time.h>
 
 
 
@@ -85,8 +86,101 @@ STATICSTR(mkdir, 5);
 STATICSTR(cat, 3);
 STATICSTR(touch, 5);
 STATICSTR(pipe, 4);
+STATICSTR(append, 6);
 STATICSTR(ls, 2);
 STATICSTR(home, 4);
+STATICSTR(frag, 4);
+STATICSTR(delalloc, 8);
+STATICSTR(clone, 5);
+STATICSTR(prealloc, 8);
+STATICSTR(cache, 5);
+STATICSTR(bench, 5);
+STATICSTR(on, 2);
+
+
+#define BENCH_FILES 2000//created, looked up and removed by each thread in its own directory
+#define BENCH_DATA_SIZE (8*MEGABYTE)//written and read back by each thread in its own file
+#define BENCH_CHUNK_SIZE (64*KILOBYTE)
+#define BENCH_THREADS_MAX 64
+
+typedef struct Bench {
+	FS* fs;
+	File* dir;
+	int thread_i;
+	bool is_data;
+	bool ok;
+} Bench;
+
+double get_time() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec/1e9;
+}
+void* bench_main(void* arg) {
+	Bench* bench = cast(Bench*, arg);
+	FS* fs = bench->fs;
+	char own_name[32];
+	uint16 own_name_size = sprintf(own_name, "bench_%d", bench->thread_i);
+	char name[32];
+	File* dir;
+	bench->ok = 0;
+	if(!bench->is_data) {
+		//every thread works in a directory of its own, so only the dir cache and the allocators are shared
+		if(!fs_open_dir(fs, bench->dir, own_name, own_name_size, &dir) || !dir) return 0;
+		for_each_lt(i, BENCH_FILES) {
+			File* file;
+			uint16 size = sprintf(name, "file_%d", i);
+			if(!fs_open_file(fs, dir, name, size, &file) || !file) return 0;
+			fs_unpin(file);
+		}
+		for_each_lt(i, BENCH_FILES) {
+			File* file;
+			uint16 size = sprintf(name, "file_%d", i);
+			if(!fs_get_file(fs, dir, name, size, &file) || !file) return 0;
+			fs_unpin(file);
+		}
+		for_each_lt(i, BENCH_FILES) {
+			uint16 size = sprintf(name, "file_%d", i);
+			if(!fs_unlink(fs, dir, name, size)) return 0;
+		}
+		fs_unpin(dir);
+		bench->ok = fs_rmdir(fs, bench->dir, own_name, own_name_size);
+	} else {
+		File* file;
+		if(!fs_open_file(fs, bench->dir, own_name, own_name_size, &file) || !file) return 0;
+		byte* mem = cast(byte*, malloc(BENCH_CHUNK_SIZE));
+		memset(mem, bench->thread_i, BENCH_CHUNK_SIZE);
+		bool ok = 1;
+		for(uint64 offset = 0; ok && offset < BENCH_DATA_SIZE; offset += BENCH_CHUNK_SIZE) {
+			ok = fs_write(fs, file, offset, mem, BENCH_CHUNK_SIZE);
+		}
+		for(uint64 offset = 0; ok && offset < BENCH_DATA_SIZE; offset += BENCH_CHUNK_SIZE) {
+			ok = fs_read(fs, file, offset, mem, BENCH_CHUNK_SIZE);
+		}
+		free(mem);
+		fs_unpin(file);
+		bench->ok = ok && fs_unlink(fs, bench->dir, own_name, own_name_size);
+	}
+	return 0;
+}
+bool run_bench(FS* fs, File* dir, int threads_size, bool is_data, double* ret_time) {
+	//runs threads_size threads at once in concurrent mode, then saves so the space they took comes back
+	Bench benches[BENCH_THREADS_MAX];
+	pthread_t threads[BENCH_THREADS_MAX];
+	if(!fs_set_concurrent(fs, 1)) return 0;
+	double start = get_time();
+	for_each_lt(i, threads_size) {
+		benches[i] = (Bench){fs, dir, i, is_data, 0};
+		pthread_create(&threads[i], 0, bench_main, &benches[i]);
+	}
+	bool ok = 1;
+	for_each_lt(i, threads_size) {
+		pthread_join(threads[i], 0);
+		ok = ok && benches[i].ok;
+	}
+	*ret_time = get_time() - start;
+	return fs_set_concurrent(fs, 0) && fs_save(fs) && ok;
+}
 
 
 int main(int argc, char** argv) {
@@ -128,10 +222,17 @@ int main(int argc, char** argv) {
 			printf("%s - navigates into a new directory\n", str_cd.ptr);
 			printf("%s - creates a new file\n", str_touch.ptr);
 			printf("%s - writes data to a file\n", str_pipe.ptr);
+			printf("%s - writes data to the end of a file\n", str_append.ptr);
 			printf("%s - prints the contents of a file\n", str_cat.ptr);
 			printf("%s - creates a new directory\n", str_mkdir.ptr);
 			printf("%s - sets the current working directory to the root directory\n", str_home.ptr);
-			printf("file paths are not implemented\n");
+			printf("%s - reports how many extents a file's blocks are split into\n", str_frag.ptr);
+			printf("%s - turns delayed block allocation on or off\n", str_delalloc.ptr);
+			printf("%s - copies a file without copying its data\n", str_clone.ptr);
+			printf("%s - allocates the blocks of a file up to a size ahead of writing it\n", str_prealloc.ptr);
+			printf("%s - reports how well the directory cache is doing\n", str_cache.ptr);
+			printf("%s - measures creating, looking up and removing files, and writing and reading them, from 1 up to a number of threads at once\n", str_bench.ptr);
+			printf("files can be given as paths separated by /, starting from the root if they begin with /\n");
 		} else if(string_compare(*cur_token, str_newfs) == 0) {
 			if(tokens.size >= 3) {
 				cur_token += 1;
@@ -150,8 +251,11 @@ int main(int argc, char** argv) {
 					if(!fs_init(fs, device_name, capacity)) {
 						fs = 0;
 						fprintf(stderr, "an error occurred attempting to create fs\n");
+					} else {
+						//the working directory has to stay cached between commands
+						cwd = fs_get_root(fs);
+						fs_pin(cwd);
 					}
-					cwd = fs_get_root(fs);
 				} else {
 					fprintf(stderr, "the entered capacity is too small; Minimum is %ld bytes\n", MEGABYTE);
 				}
@@ -173,8 +277,10 @@ int main(int argc, char** argv) {
 				if(!fs_mount(fs, device_name)) {
 					fs = 0;
 					fprintf(stderr, "an error occurred attempting to open fs\n");
+				} else {
+					cwd = fs_get_root(fs);
+					fs_pin(cwd);
 				}
-				cwd = fs_get_root(fs);
 			} else {
 				fprintf(stderr, "usage: usefs <filename>\n");
 			}
@@ -189,8 +295,10 @@ int main(int argc, char** argv) {
 				if(tokens.size >= 2) {
 					cur_token += 1;
 					File* dir;
-					if(fs_get_dir(fs, cwd, cur_token->ptr, cur_token->size, &dir)) {
+					if(fs_resolve_path(fs, cwd, cur_token->ptr, cur_token->size, FS_PATH_DIR, &dir)) {
 						if(dir) {
+							fs_pin(dir);
+							fs_unpin(cwd);
 							cwd = dir;
 						} else {
 							printf("the directory \"%.*s\" was not found\n", cur_token->size, cur_token->ptr);
@@ -205,9 +313,9 @@ int main(int argc, char** argv) {
 				if(tokens.size >= 2) {
 					cur_token += 1;
 					File* dir;
-					if(fs_open_dir(fs, cwd, cur_token->ptr, cur_token->size, &dir)) {
+					if(fs_resolve_path(fs, cwd, cur_token->ptr, cur_token->size, FS_PATH_DIR | FS_PATH_CREATE, &dir)) {
 						if(!dir) {
-							printf("the directory \"%.*s\" could not be created; the filename is already taken\n", cur_token->size, cur_token->ptr);
+							printf("the directory \"%.*s\" could not be created; the filename is taken or a directory on its path is missing\n", cur_token->size, cur_token->ptr);
 						}
 					} else {
 						fprintf(stderr, "error attempting to create directory\n");
@@ -219,14 +327,26 @@ int main(int argc, char** argv) {
 				if(tokens.size >= 2) {
 					cur_token += 1;
 					File* file;
-					if(fs_get_file(fs, cwd, cur_token->ptr, cur_token->size, &file)) {
+					if(fs_resolve_path(fs, cwd, cur_token->ptr, cur_token->size, FS_PATH_FILE, &file)) {
 						if(file) {
-							uint64 size = fs_get_size(file);
-							char* contents = (char*)malloc(size + 1);
-							fs_read(fs, file, 0, contents, size);
-							contents[size] = 0;
-							printf("%s\n", contents);
-							free(contents);
+							//stream the file straight out of the device through views, nothing is copied
+							uint64 size = 0;
+							if(!fs_get_size(fs, file, &size)) {
+								fprintf(stderr, "error attempting to read file\n");
+							}
+							uint64 offset = 0;
+							while(offset < size) {
+								const void* view;
+								uint64 view_size;
+								if(!fs_acquire_view(fs, file, offset, size - offset, &view, &view_size)) {
+									fprintf(stderr, "error attempting to read file\n");
+									break;
+								}
+								fwrite(view, 1, view_size, stdout);
+								fs_release_view(fs, file, view);
+								offset += view_size;
+							}
+							printf("\n");
 						} else {
 							printf("the file \"%.*s\" was not found\n", cur_token->size, cur_token->ptr);
 						}
@@ -240,9 +360,9 @@ int main(int argc, char** argv) {
 				if(tokens.size == 2) {
 					cur_token += 1;
 					File* file;
-					if(fs_open_file(fs, cwd, cur_token->ptr, cur_token->size, &file)) {
+					if(fs_resolve_path(fs, cwd, cur_token->ptr, cur_token->size, FS_PATH_FILE | FS_PATH_CREATE, &file)) {
 						if(!file) {
-							printf("the file \"%.*s\" could not be created; the filename is already taken\n", cur_token->size, cur_token->ptr);
+							printf("the file \"%.*s\" could not be created; the filename is taken or a directory on its path is missing\n", cur_token->size, cur_token->ptr);
 						}
 					} else {
 						fprintf(stderr, "error attempting to create file\n");
@@ -257,13 +377,13 @@ int main(int argc, char** argv) {
 					uint filename_size = cur_token->size;
 					cur_token += 1;
 					File* file;
-					if(fs_open_file(fs, cwd, filename, filename_size, &file)) {
+					if(fs_resolve_path(fs, cwd, filename, filename_size, FS_PATH_FILE | FS_PATH_CREATE, &file)) {
 						if(file) {
 							if(!fs_write(fs, file, 0, cur_token->ptr, cur_token->size)) {
 								fprintf(stderr, "error attempting to write to file\n");
 							}
 						} else {
-							printf("the file \"%.*s\" could not be created; the filename is already taken\n", cur_token->size, cur_token->ptr);
+							printf("the file \"%.*s\" could not be created; the filename is taken or a directory on its path is missing\n", filename_size, filename);
 						}
 					} else {
 						fprintf(stderr, "error attempting to create file\n");
@@ -271,23 +391,153 @@ int main(int argc, char** argv) {
 				} else {
 					fprintf(stderr, "usage: pipe <filename> <data string>\n");
 				}
+			} else if(string_compare(*cur_token, str_append) == 0) {
+				if(tokens.size >= 3) {
+					cur_token += 1;
+					char* filename = cur_token->ptr;
+					uint filename_size = cur_token->size;
+					cur_token += 1;
+					File* file;
+					if(fs_resolve_path(fs, cwd, filename, filename_size, FS_PATH_FILE | FS_PATH_CREATE, &file)) {
+						if(file) {
+							if(!fs_append(fs, file, cur_token->ptr, cur_token->size)) {
+								fprintf(stderr, "error attempting to append to file\n");
+							}
+						} else {
+							printf("the file \"%.*s\" could not be created; the filename is taken or a directory on its path is missing\n", filename_size, filename);
+						}
+					} else {
+						fprintf(stderr, "error attempting to create file\n");
+					}
+				} else {
+					fprintf(stderr, "usage: append <filename> <data string>\n");
+				}
 			} else if(string_compare(*cur_token, str_ls) == 0) {
-				File* file;
-				if(fs_get_first_child(fs, cwd, &file)) {
-					while(file) {
-						uint size = fs_filename_size(file);
-						char* name = (char*)malloc(size + 1);
-						fs_get_filename(file, name);
-						name[size] = 0;
-						printf("%s\n", name);
-						free(name);
-						file = fs_get_next_child(fs, cwd, file);
+				//the entries are read straight from the directory, so listing it caches none of them
+				DirReader* reader;
+				if(fs_open_reader(fs, cwd, &reader)) {
+					DirEntry* entry;
+					while(1) {
+						if(!fs_read_dir(fs, reader, &entry)) {
+							fprintf(stderr, "error attempting to read dir contents\n");
+							break;
+						}
+						if(!entry) break;
+						printf("%.*s\n", entry->name_size, entry->name);
 					}
+					fs_close_reader(fs, reader);
 				} else {
 					fprintf(stderr, "error attempting to read dir contents\n");
 				}
 			} else if(string_compare(*cur_token, str_home) == 0) {
+				fs_unpin(cwd);
 				cwd = fs_get_root(fs);
+				fs_pin(cwd);
+			} else if(string_compare(*cur_token, str_frag) == 0) {
+				if(tokens.size >= 2) {
+					cur_token += 1;
+					File* file;
+					if(fs_resolve_path(fs, cwd, cur_token->ptr, cur_token->size, FS_PATH_FILE, &file)) {
+						if(file) {
+							int64 blocks_size;
+							int64 extents_size;
+							if(fs_get_extents(fs, file, &blocks_size, &extents_size)) {
+								printf("%ld blocks in %ld extents\n", blocks_size, extents_size);
+							} else {
+								fprintf(stderr, "error attempting to read file blocks\n");
+							}
+						} else {
+							printf("the file \"%.*s\" was not found\n", cur_token->size, cur_token->ptr);
+						}
+					} else {
+						fprintf(stderr, "error attempting to find file\n");
+					}
+				} else {
+					fprintf(stderr, "usage: frag <filename>\n");
+				}
+			} else if(string_compare(*cur_token, str_clone) == 0) {
+				if(tokens.size >= 3) {
+					cur_token += 1;
+					File* file;
+					if(fs_resolve_path(fs, cwd, cur_token->ptr, cur_token->size, FS_PATH_FILE, &file)) {
+						if(file) {
+							cur_token += 1;
+							File* new_file;
+							if(fs_clone_file(fs, cwd, cur_token->ptr, cur_token->size, file, &new_file)) {
+								if(!new_file) {
+									printf("the file \"%.*s\" could not be created; the filename is already taken\n", cur_token->size, cur_token->ptr);
+								}
+							} else {
+								fprintf(stderr, "error attempting to clone file\n");
+							}
+						} else {
+							printf("the file \"%.*s\" was not found\n", cur_token->size, cur_token->ptr);
+						}
+					} else {
+						fprintf(stderr, "error attempting to find file\n");
+					}
+				} else {
+					fprintf(stderr, "usage: clone <filename> <new filename>\n");
+				}
+			} else if(string_compare(*cur_token, str_prealloc) == 0) {
+				if(tokens.size >= 3) {
+					cur_token += 1;
+					char* filename = cur_token->ptr;
+					uint filename_size = cur_token->size;
+					cur_token += 1;
+					cur_token->ptr[cur_token->size] = 0;//NOTE: We're overwritting the spaces with null terminators
+					uint64 size = atoll(cur_token->ptr);
+					File* file;
+					if(fs_resolve_path(fs, cwd, filename, filename_size, FS_PATH_FILE | FS_PATH_CREATE, &file)) {
+						if(file) {
+							if(!fs_preallocate(fs, file, 0, size)) {
+								fprintf(stderr, "error attempting to preallocate file\n");
+							}
+						} else {
+							printf("the file \"%.*s\" could not be created; the filename is taken or a directory on its path is missing\n", filename_size, filename);
+						}
+					} else {
+						fprintf(stderr, "error attempting to create file\n");
+					}
+				} else {
+					fprintf(stderr, "usage: prealloc <filename> <size>\n");
+				}
+			} else if(string_compare(*cur_token, str_cache) == 0) {
+				printf("%lu hits, %lu misses, %lu missing names remembered, %lu directories evicted holding %lu files\n", fs->cache_hits, fs->cache_misses, fs->cache_negative_hits, fs->cache_evictions, fs->cache_files_evicted);
+			} else if(string_compare(*cur_token, str_bench) == 0) {
+				if(tokens.size >= 2) {
+					cur_token += 1;
+					cur_token->ptr[cur_token->size] = 0;
+					int threads_max = atoi(cur_token->ptr);
+					if(threads_max >= 1 && threads_max <= BENCH_THREADS_MAX) {
+						//the thread counts double up to threads_max, so the rate at each shows how far the calls scale
+						for(int threads_size = 1;; threads_size = (2*threads_size < threads_max) ? 2*threads_size : threads_max) {
+							double meta_time;
+							double data_time;
+							if(!run_bench(fs, cwd, threads_size, 0, &meta_time) || !run_bench(fs, cwd, threads_size, 1, &data_time)) {
+								fprintf(stderr, "error attempting to run bench with %d threads\n", threads_size);
+								break;
+							}
+							double meta_ops = 3.0*BENCH_FILES*threads_size;
+							double data_mb = 2.0*BENCH_DATA_SIZE*threads_size/MEGABYTE;
+							printf("%d threads: %.0f file operations/s, %.0f MB/s written and read\n", threads_size, meta_ops/meta_time, data_mb/data_time);
+							if(threads_size == threads_max) break;
+						}
+					} else {
+						fprintf(stderr, "the number of threads must be between 1 and %d\n", BENCH_THREADS_MAX);
+					}
+				} else {
+					fprintf(stderr, "usage: bench <threads>\n");
+				}
+			} else if(string_compare(*cur_token, str_delalloc) == 0) {
+				if(tokens.size >= 2) {
+					cur_token += 1;
+					if(!fs_set_delayed_alloc(fs, string_compare(*cur_token, str_on) == 0)) {
+						fprintf(stderr, "error attempting to flush delayed data, delayed allocation is still on\n");
+					}
+				} else {
+					fprintf(stderr, "usage: delalloc <on|off>\n");
+				}
 			} else {
 				fprintf(stderr, "unrecognized command\n");
 			}